@@ -0,0 +1,369 @@
+// Codec Benchmark
+//
+// Times every codec in libcodec.a over a set of input files. Each input is
+// compressed and decompressed a few times to warm up the caches, then timed
+// over a number of runs with std::chrono::steady_clock. The results give the
+// compression ratio, the min, median and 99th percentile times of each
+// direction, and the throughput in MB/s (of original data, at the median).
+//
+// Small files finish in microseconds, so "-g <MiB>" adds larger inputs of
+// that size from two of generator's distributions, order-3 Markov text and
+// Zipf bytes, at a fixed seed so every run measures the same data.
+//
+// The results are printed as a table, and written as CSV or JSON to each file
+// given with "-o", depending on its extension, for tracking regressions.
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+
+#include "Codec.h"
+#include "Generator.h"
+#include "MappedFile.h"
+#include "Stats.h"
+
+// A codec with the settings it is benchmarked with
+struct BenchConfig {
+    std::string name;
+    std::string codec;
+    CodecOptions options;
+};
+
+std::vector<BenchConfig> bench_configs(int threads) {
+    CodecOptions blocks, streams, order1, lz1, lz6, lz9, ans, ansBest;
+    CodecOptions segments;
+    blocks.blockSize = 1 << 20;
+    streams.blockSize = 1 << 20;
+    streams.streams = 4;
+    order1.contexts = true;
+    lz1.lzLevel = 1;
+    lz6.lzLevel = 6;
+    lz9.lzLevel = 9;
+    ans.coder = CODER_ANS;
+    ansBest.blockSize = 1 << 20;
+    ansBest.coder = CODER_BEST;
+    segments.blockSize = 256 << 10;
+    segments.primed = true;
+
+    std::vector<BenchConfig> configs = {
+        {"huffman", "huffman", CodecOptions()},
+        {"huffman-blocks", "huffman", blocks},
+        {"huffman-4streams", "huffman", streams},
+        {"huffman-order1", "huffman", order1},
+        {"huffman-lz1", "huffman", lz1},
+        {"huffman-lz6", "huffman", lz6},
+        {"huffman-lz9", "huffman", lz9},
+        {"ans", "huffman", ans},
+        {"ans-best-blocks", "huffman", ansBest},
+        {"fgk", "fgk", CodecOptions()},
+        {"fgk-segments", "fgk", segments},
+        {"vitter", "vitter", CodecOptions()}
+    };
+    for(BenchConfig& config : configs)
+        config.options.threads = threads;
+    return configs;
+}
+
+struct BenchInput {
+    std::string name;
+    std::vector<char> data;
+};
+
+// The seed of the generated inputs, the same as generator's default
+const uint64_t BENCH_SEED = 4660;
+
+// An input of 'size' bytes drawn from a generator
+BenchInput generated_input(const std::string& name, Generator& gen,
+        uint64_t size) {
+    std::string data;
+    while(data.size() < size)
+        gen.generate(data);
+    return {name, std::vector<char>(data.begin(), data.begin() + size)};
+}
+
+// Summary of the times of one direction over all runs, in seconds
+struct TimeStats {
+    double min, median, p99;
+};
+
+TimeStats time_stats(std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    int n = times.size();
+    TimeStats stats;
+    stats.min = times[0];
+    stats.median = n % 2 ? times[n/2] : (times[n/2 - 1] + times[n/2]) / 2;
+    // Nearest rank
+    stats.p99 = times[std::min(n - 1, (int)std::ceil(0.99 * n) - 1)];
+    return stats;
+}
+
+struct BenchResult {
+    std::string config;
+    std::string input;
+    uint64_t size;
+    uint64_t compressedSize;
+    TimeStats compress, decompress;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()
+            - start).count();
+}
+
+// Time a codec over one input. Returns false if the round trip doesn't give
+// back the original data.
+bool bench(Codec* codec, BenchInput& input, int warmup, int runs,
+        BenchResult& result) {
+    char* data = input.data.data();
+    uint64_t N = input.data.size();
+    std::vector<double> compressTimes, decompressTimes;
+
+    for(int run=0; run<warmup+runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<char>* encoded = codec->compress(data, N);
+        double compressTime = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        std::vector<char>* decoded = codec->decompress(encoded->data(),
+                encoded->size());
+        double decompressTime = seconds_since(start);
+
+        bool matching = decoded && decoded->size() == N
+            && (N == 0 || !memcmp(data, decoded->data(), N));
+        result.compressedSize = encoded->size();
+        delete encoded;
+        delete decoded;
+        if(!matching)
+            return false;
+
+        if(run >= warmup) {
+            compressTimes.push_back(compressTime);
+            decompressTimes.push_back(decompressTime);
+        }
+    }
+
+    result.size = N;
+    result.compress = time_stats(compressTimes);
+    result.decompress = time_stats(decompressTimes);
+    return true;
+}
+
+double ratio(const BenchResult& r) {
+    return r.size ? (double)r.compressedSize / r.size : 0;
+}
+
+double mb_per_sec(uint64_t size, double seconds) {
+    return seconds > 0 ? size / seconds / 1e6 : 0;
+}
+
+void print_table(std::ostream& os, const std::vector<BenchResult>& results) {
+    os << std::left << std::setw(18) << "codec" << std::setw(22) << "input"
+       << std::right << std::setw(11) << "size" << std::setw(8) << "ratio"
+       << std::setw(10) << "comp MB/s" << std::setw(10) << "dec MB/s"
+       << std::setw(10) << "comp ms" << std::setw(10) << "dec ms"
+       << std::setw(10) << "dec p99" << "\n";
+    for(const BenchResult& r : results) {
+        std::string input = r.input.substr(r.input.find_last_of('/') + 1);
+        os << std::left << std::setw(18) << r.config << std::setw(22)
+           << input.substr(0, 21) << std::right << std::setw(11) << r.size
+           << std::fixed << std::setprecision(3) << std::setw(8) << ratio(r)
+           << std::setprecision(1)
+           << std::setw(10) << mb_per_sec(r.size, r.compress.median)
+           << std::setw(10) << mb_per_sec(r.size, r.decompress.median)
+           << std::setprecision(3)
+           << std::setw(10) << r.compress.median * 1e3
+           << std::setw(10) << r.decompress.median * 1e3
+           << std::setw(10) << r.decompress.p99 * 1e3 << "\n";
+    }
+}
+
+// A string as a CSV field, quoted with any quotes in it doubled, since file
+// names can hold commas, quotes and newlines
+std::string csv_field(const std::string& s) {
+    std::string quoted = "\"";
+    for(char c : s) {
+        if(c == '"')
+            quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+void write_csv(std::ostream& os, const std::vector<BenchResult>& results) {
+    os << "codec,input,size,compressed_size,ratio,compress_mbps,"
+          "decompress_mbps,compress_min_s,compress_median_s,compress_p99_s,"
+          "decompress_min_s,decompress_median_s,decompress_p99_s\n";
+    for(const BenchResult& r : results) {
+        os << csv_field(r.config) << "," << csv_field(r.input) << ","
+           << r.size << ","
+           << r.compressedSize << "," << ratio(r) << ","
+           << mb_per_sec(r.size, r.compress.median) << ","
+           << mb_per_sec(r.size, r.decompress.median) << ","
+           << r.compress.min << "," << r.compress.median << ","
+           << r.compress.p99 << "," << r.decompress.min << ","
+           << r.decompress.median << "," << r.decompress.p99 << "\n";
+    }
+}
+
+// A string as a JSON string literal, with quotes, backslashes and control
+// characters escaped, since file names can hold any of them
+std::string json_string(const std::string& s) {
+    std::string quoted = "\"";
+    for(unsigned char c : s) {
+        if(c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if(c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+void write_json(std::ostream& os, const std::vector<BenchResult>& results) {
+    os << "[\n";
+    for(size_t i=0; i<results.size(); i++) {
+        const BenchResult& r = results[i];
+        os << "  {\"codec\": " << json_string(r.config)
+           << ", \"input\": " << json_string(r.input)
+           << ", \"size\": " << r.size
+           << ", \"compressed_size\": " << r.compressedSize
+           << ", \"ratio\": " << ratio(r)
+           << ", \"compress_mbps\": " << mb_per_sec(r.size, r.compress.median)
+           << ", \"decompress_mbps\": "
+           << mb_per_sec(r.size, r.decompress.median)
+           << ", \"compress_s\": {\"min\": " << r.compress.min
+           << ", \"median\": " << r.compress.median
+           << ", \"p99\": " << r.compress.p99 << "}"
+           << ", \"decompress_s\": {\"min\": " << r.decompress.min
+           << ", \"median\": " << r.decompress.median
+           << ", \"p99\": " << r.decompress.p99 << "}}"
+           << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+}
+
+bool has_suffix(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size()
+        && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void usage() {
+    std::cerr << "usage: Bench [-r runs] [-w warmup runs] [-g generated MiB] "
+                 "[-c codec,...] [-t threads] [-o results.csv|.json] <file>..."
+              << std::endl;
+}
+
+int main (int argc, char *argv[]) {
+    STAT_START("Bench");
+    int runs = 10, warmup = 2;
+    uint64_t generated = 0;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    std::set<std::string> only;
+    std::vector<std::string> outputs;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:g:o:r:t:w:")) != -1) {
+        switch(opt) {
+            case 'c': {
+                std::stringstream names(optarg);
+                std::string name;
+                while(std::getline(names, name, ','))
+                    only.insert(name);
+                break;
+            }
+            case 'g': generated = atoll(optarg) << 20; break;
+            case 'o': outputs.push_back(optarg); break;
+            case 'r': runs = std::max(1, atoi(optarg)); break;
+            case 't': threads = std::max(1, atoi(optarg)); break;
+            case 'w': warmup = std::max(0, atoi(optarg)); break;
+            default: usage(); return -1;
+        }
+    }
+    if(optind >= argc && !generated) {
+        std::cerr << "no filename provided" << std::endl;
+        usage();
+        return -1;
+    }
+    for(std::string& name : outputs) {
+        if(!has_suffix(name, ".csv") && !has_suffix(name, ".json")) {
+            std::cerr << "results file must end in .csv or .json" << std::endl;
+            return -1;
+        }
+    }
+
+    // Every codec asked for has to be one of the configs
+    std::vector<BenchConfig> configs = bench_configs(threads);
+    for(const std::string& name : only) {
+        bool found = false;
+        for(BenchConfig& config : configs)
+            found |= config.name == name;
+        if(!found) {
+            std::cerr << "unknown codec: " << name << "\nvalid codecs are:";
+            for(BenchConfig& config : configs)
+                std::cerr << " " << config.name;
+            std::cerr << std::endl;
+            return -1;
+        }
+    }
+
+    // Read the inputs
+    std::vector<BenchInput> inputs;
+    for(int i=optind; i<argc; i++) {
+        MappedFile file;
+        if(!file.open_read(argv[i])) {
+            std::cerr << "error opening file " << argv[i] << std::endl;
+            return -1;
+        }
+        inputs.push_back({argv[i],
+                std::vector<char>(file.data, file.data + file.size)});
+    }
+    if(generated > 0) {
+        std::string size = std::to_string(generated >> 20) + "MiB";
+        Random rnd(BENCH_SEED);
+        MarkovGenerator markov(rnd, TRAINING_TEXT, 3);
+        inputs.push_back(generated_input("markov-" + size, markov, generated));
+        ZipfGenerator zipf(rnd, 1.0);
+        inputs.push_back(generated_input("zipf-" + size, zipf, generated));
+    }
+
+    std::vector<BenchResult> results;
+    for(BenchConfig& config : configs) {
+        if(!only.empty() && !only.count(config.name))
+            continue;
+
+        Codec* codec = make_codec(config.codec, config.options);
+        for(BenchInput& input : inputs) {
+            BenchResult result;
+            result.config = config.name;
+            result.input = input.name;
+            if(!bench(codec, input, warmup, runs, result)) {
+                std::cerr << config.name << ": round trip failed on "
+                          << input.name << std::endl;
+                delete codec;
+                return 1;
+            }
+            results.push_back(result);
+        }
+        delete codec;
+    }
+
+    print_table(std::cout, results);
+    for(std::string& name : outputs) {
+        std::ofstream ofs(name);
+        ofs << std::setprecision(9);
+        if(has_suffix(name, ".csv"))
+            write_csv(ofs, results);
+        else
+            write_json(ofs, results);
+        if(!ofs) {
+            std::cerr << "error writing " << name << std::endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+// Bit Level Input and Output
+//
+// Shared by the compression programs to write and read variable length codes.
+// Codes are packed most significant bit first, so the first bit written is
+// the top bit of the first byte. Also has the helpers for the fixed and
+// variable size integers in file headers, and for the adaptive coders'
+// streaming modes, which read and write files a chunk at a time.
+
+#ifndef BIT_IO_H
+#define BIT_IO_H
+
+#include <bits/stdc++.h>
+
+#include "Stats.h"
+
+// Size of the pieces files are read and written in when streaming
+const int CHUNK_SIZE = 1 << 20;
+
+// Write 'bytes' bytes of 'value' to the output, little endian
+inline void put_int(std::vector<char>* output, uint64_t value, int bytes) {
+    for(int b=0; b<bytes; b++)
+        output->push_back(value >> (8*b) & 0xFF);
+}
+
+inline uint64_t get_int(char* buffer, int bytes) {
+    uint64_t value = 0;
+    for(int b=0; b<bytes; b++)
+        value |= (uint64_t)(unsigned char)buffer[b] << (8*b);
+    return value;
+}
+
+// Write 'value' in as few bytes as it needs, 7 bits a byte starting with the
+// lowest, with the top bit set on every byte but the last
+inline void put_varint(std::vector<char>* output, uint64_t value) {
+    while(value >= 0x80) {
+        output->push_back((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    output->push_back(value);
+}
+
+// Read a value written by put_varint() from at most N bytes. Returns the
+// number of bytes it took, or -1 if it doesn't end within them.
+inline int get_varint(char* buffer, uint64_t N, uint64_t& value) {
+    value = 0;
+    for(int b=0; b<10 && (uint64_t)b<N; b++) {
+        uint64_t byte = (unsigned char)buffer[b];
+        value |= (byte & 0x7F) << (7*b);
+        if(!(byte & 0x80))
+            return b + 1;
+    }
+    return -1;
+}
+
+// Code of a symbol, right-aligned in 'bits'
+struct Code {
+    uint64_t bits;
+    int len;
+};
+
+// Packs codes MSB-first into a 64-bit accumulator and stores it to the
+// output a whole word at a time. The output vector is used as a flat buffer:
+// 'pos' is the number of bytes written so far, and the vector is only grown
+// if the caller's size estimate turns out to be too small.
+struct BitWriter {
+    std::vector<char>* output;
+    size_t pos = 0;
+    uint64_t acc = 0;
+    int count = 0;
+
+    BitWriter(std::vector<char>* output) : output(output) {};
+
+    void write_word(uint64_t word) {
+        if(pos + 8 > output->size()) {
+            STAT_ADD(OUTPUT_REALLOCS, 1);
+            output->resize(2*output->size() + 8);
+        }
+        word = __builtin_bswap64(word);
+        memcpy(output->data() + pos, &word, 8);
+        pos += 8;
+    }
+
+    // Write the low 'len' bits of 'bits', where 'len' is less than 64
+    void put(uint64_t bits, int len) {
+        if(count + len < 64) {
+            acc = (acc << len) | bits;
+            count += len;
+            return;
+        }
+
+        // Fill the accumulator, store it, and keep the bits that didn't fit
+        int spill = count + len - 64;
+        write_word((acc << (len - spill)) | (bits >> spill));
+        acc = bits & ((1ULL << spill) - 1);
+        count = spill;
+    }
+
+    // Store the remaining bits, padded with zeros to a whole byte, and trim
+    // the output to the bytes actually written.
+    void flush() {
+        if(pos + 8 > output->size())
+            output->resize(pos + 8);
+        for(int shift=count-8; shift>-8; shift-=8)
+            (*output)[pos++] = shift >= 0 ? acc >> shift : acc << -shift;
+        output->resize(pos);
+        acc = 0;
+        count = 0;
+    }
+};
+
+// Reads the compressed data, either from a buffer in memory or from a stream
+// which is read a chunk at a time. The next bits are kept in a 64-bit
+// accumulator, so several can be looked at before deciding how many to use.
+// Past the end of the data it reads zeros and sets 'exhausted'.
+struct BitReader {
+    std::istream* is = nullptr;
+    std::vector<char> chunk;
+
+    char* data;
+    uint64_t size;
+    uint64_t pos = 0;
+
+    // Next bits, first one at the top, and how many of them there are. The
+    // last 'padding' of them are the zeros past the end of the data.
+    uint64_t acc = 0;
+    int count = 0;
+    int padding = 0;
+    bool exhausted = false;
+
+    BitReader(char* data, uint64_t N) : data(data), size(N) {};
+    BitReader(std::istream& is) : is(&is), chunk(CHUNK_SIZE), size(0) {
+        data = chunk.data();
+    };
+
+    // Top up the accumulator a byte at a time
+    void refill() {
+        while(count <= 56) {
+            if(pos == size && is) {
+                STAT_PHASE(PHASE_IO);
+                is->read(chunk.data(), chunk.size());
+                size = is->gcount();
+                pos = 0;
+            }
+            if(pos < size)
+                acc |= (uint64_t)(unsigned char)data[pos++] << (56 - count);
+            else
+                padding += 8;
+            count += 8;
+        }
+    }
+
+    // Next 'n' bits, without using them up
+    uint64_t peek(int n) {
+        refill();
+        return acc >> (64 - n);
+    }
+
+    void consume(int n) {
+        acc <<= n;
+        count -= n;
+        if(count < padding) {
+            exhausted = true;
+            padding = count;
+        }
+    }
+
+    int bit() {
+        int b = peek(1);
+        consume(1);
+        return b;
+    }
+};
+
+// Encode a stream a chunk at a time. 'encode_chunk(data, n)' codes each chunk
+// into the writer, and the whole words written so far go out after each one,
+// with the writer keeping the rest. Finishing the data is up to the caller.
+// Returns the number of bytes read.
+template<class EncodeChunk>
+uint64_t encode_chunks(std::istream& is, std::ostream& os, BitWriter& writer,
+        EncodeChunk encode_chunk) {
+    std::vector<char> chunk(CHUNK_SIZE);
+    uint64_t total = 0;
+    while(is) {
+        uint64_t n;
+        {
+            STAT_PHASE(PHASE_IO);
+            is.read(chunk.data(), chunk.size());
+            n = is.gcount();
+            total += n;
+        }
+
+        encode_chunk(chunk.data(), n);
+        STAT_PHASE(PHASE_IO);
+        os.write(writer.output->data(), writer.pos);
+        writer.pos = 0;
+    }
+    return total;
+}
+
+// Decode to a stream a chunk at a time. 'decode_chunk(output)' adds up to
+// CHUNK_SIZE bytes to the output, and returns false once the data has ended.
+template<class DecodeChunk>
+void decode_chunks(std::ostream& os, DecodeChunk decode_chunk) {
+    std::vector<char> output;
+    bool more = true;
+    while(more) {
+        more = decode_chunk(&output);
+        STAT_PHASE(PHASE_IO);
+        os.write(output.data(), output.size());
+        output.clear();
+    }
+}
+
+// Compare two files a chunk at a time
+inline bool files_match(const char* a, const char* b) {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    std::vector<char> ca(CHUNK_SIZE), cb(CHUNK_SIZE);
+    while(fa && fb) {
+        fa.read(ca.data(), CHUNK_SIZE);
+        fb.read(cb.data(), CHUNK_SIZE);
+        if(fa.gcount() != fb.gcount()
+                || memcmp(ca.data(), cb.data(), fa.gcount()))
+            return false;
+    }
+    return !fa && !fb;
+}
+
+#endif
@@ -0,0 +1,16 @@
+// Codec Library Registry
+//
+// Maps codec names to the codecs in libcodec.a
+
+#include <bits/stdc++.h>
+
+#include "Codec.h"
+
+const char* CODEC_NAMES[] = {"huffman", "fgk", "vitter", nullptr};
+
+Codec* make_codec(const std::string& name, const CodecOptions& options) {
+    if(name == "huffman") return new_huffman_codec(options);
+    if(name == "fgk") return new_fgk_codec(options);
+    if(name == "vitter") return new_vitter_codec(options);
+    return nullptr;
+}
@@ -0,0 +1,89 @@
+// Codec Library Interface
+//
+// Every compression method in this project is available through the Codec
+// interface below, so programs can compress or decompress in one direction
+// without the round trip the demo programs go through. The codecs are built
+// into libcodec.a, and make_codec() picks one by name.
+//
+// Buffers are handled in memory, and streams a chunk at a time for data
+// larger than RAM. The Huffman codec needs seekable streams, since it fills in
+// its block index once the blocks are written.
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <bits/stdc++.h>
+
+// Entropy coders of the Huffman codec: canonical Huffman codes, tANS, or
+// whichever of the two codes each block (or the whole file) smaller
+enum EntropyCoder { CODER_HUFFMAN, CODER_ANS, CODER_BEST };
+
+// Settings for all the codecs. Each codec uses the ones that apply to it and
+// ignores the rest. Every format records the settings its decoder needs, so
+// data can be decompressed with the default options, apart from a Huffman
+// dictionary.
+struct CodecOptions {
+    int threads = 1;
+    uint64_t blockSize = 0;     // Huffman blocks or FGK segments, 0 for none
+    int streams = 1;            // Huffman interleaved streams per block
+    bool shared = false;        // Huffman code table shared by all blocks
+    int maxCodeLen = 56;        // Huffman code length limit
+    bool contexts = false;      // Huffman order-1 tables, without blocks
+    int lzLevel = 0;            // Huffman LZ77 level 1-9, 0 for none
+    int lzWindowBits = 20;      // Huffman LZ77 window of 2^bits bytes
+    EntropyCoder coder = CODER_HUFFMAN;  // Huffman codec's entropy coder
+    std::string dictionary;     // Huffman trained code table file, or none
+    int rescaleAt = 1 << 30;    // FGK weight total that triggers halving
+    uint64_t window = 0;        // FGK symbols between tree resets
+    bool primed = false;        // FGK segments start from whole file weights
+};
+
+struct Codec {
+    virtual ~Codec() {};
+
+    // Compress a buffer, returning the compressed data
+    virtual std::vector<char>* compress(char* data, uint64_t N) = 0;
+
+    // Decompress a buffer. Returns nullptr if it is not valid compressed data.
+    virtual std::vector<char>* decompress(char* data, uint64_t N) = 0;
+
+    // Compress or decompress from one stream to another.
+    // Returns false on invalid data or a read or write error.
+    virtual bool compress(std::istream& is, std::ostream& os) = 0;
+    virtual bool decompress(std::istream& is, std::ostream& os) = 0;
+};
+
+Codec* new_huffman_codec(const CodecOptions& options);
+Codec* new_fgk_codec(const CodecOptions& options);
+Codec* new_vitter_codec(const CodecOptions& options);
+
+// Train a Huffman code table on the sample files and save it as a dictionary
+// for CodecOptions::dictionary. Returns false on a read or write error.
+bool train_huffman_dictionary(const std::vector<std::string>& samples,
+        const std::string& filename, int maxCodeLen = 56);
+
+// Why Huffman compressed data can't be decompressed with the options'
+// dictionary: it was compressed with one, and none or another one is given.
+// Returns an empty string if the dictionary is not the problem.
+std::string check_huffman_dictionary(const CodecOptions& options, char* data,
+        uint64_t N);
+
+// Entropy coder of the given name (huffman, ans or best). Returns false if
+// there is none.
+bool parse_entropy_coder(const std::string& name, EntropyCoder& coder);
+
+// Check the Huffman codec's options for values out of range and settings
+// that can't be used together, so every program rejects the same ones.
+// 'streaming' is whether the data goes through the stream methods. Returns
+// what is wrong, or an empty string.
+std::string check_huffman_options(const CodecOptions& options,
+        bool streaming);
+
+// Names accepted by make_codec()
+extern const char* CODEC_NAMES[];
+
+// Create the codec called 'name', or return nullptr if there is none or its
+// dictionary can't be loaded
+Codec* make_codec(const std::string& name, const CodecOptions& options);
+
+#endif
@@ -0,0 +1,278 @@
+// Command Line Compressor
+//
+// Runs any of the codecs in libcodec.a in one direction at a time. Unlike
+// the demo programs, which always compress, decompress and compare against
+// fixed filenames, this only does the work that was asked for:
+//
+//   compress      compress the input to the output
+//   decompress    decompress the input to the output
+//   verify        compress and decompress the input in memory, compare the
+//                 result with the original, and report the sizes
+//   train         train a Huffman dictionary on sample files, for
+//                 compressing many small inputs with "-D"
+//
+// The input and output are named files, or standard input and output when
+// they are left out or given as "-". Files are mapped into memory, standard
+// input is read in whole. With "-m" the data is streamed through a chunk at a
+// time instead. The Huffman codec seeks, so it only streams between named
+// files; FGK and Vitter stream through standard input and output too.
+//
+// The Huffman and FGK formats describe themselves, and Vitter has no
+// settings, so decompressing needs only the codec name.
+// Huffman files compressed with a dictionary need the same dictionary.
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+
+#include "Codec.h"
+#include "MappedFile.h"
+#include "Stats.h"
+
+void usage() {
+    std::cerr << "usage: Compressor compress|decompress [options] "
+                 "[-o output] [input]\n"
+              << "       Compressor verify [options] [input]\n"
+              << "       Compressor train [-l bits] -o dictionary <sample>...\n"
+              << "options:\n"
+              << "  -c codec     huffman (default), fgk or vitter\n"
+              << "  -t threads   threads for blocks or segments\n"
+              << "  -m           stream the data instead of holding it in "
+                 "memory\n"
+              << "  -b KiB       Huffman block size or FGK segment size\n"
+              << "  -i streams   Huffman interleaved streams per block\n"
+              << "  -s           Huffman code table shared by all blocks\n"
+              << "  -l bits      Huffman max code length\n"
+              << "  -x           Huffman order-1 context tables\n"
+              << "  -z level     Huffman LZ77 stage, level 1 to 9\n"
+              << "  -W bits      Huffman LZ77 window of 2^bits bytes\n"
+              << "  -e coder     Huffman entropy coder: huffman, ans or best\n"
+              << "  -D file      Huffman trained dictionary\n"
+              << "  -r weight    FGK rescale weight\n"
+              << "  -w symbols   FGK window between tree resets\n"
+              << "  -p           prime FGK segments with the file's weights"
+              << std::endl;
+}
+
+// Read all of the input, from a file or from standard input when 'filename'
+// is null. The data is either mapped or copied into 'buffer'.
+bool read_input(const char* filename, MappedFile& mapped,
+        std::vector<char>& buffer, char*& data, uint64_t& N) {
+    STAT_PHASE(PHASE_IO);
+    if(filename) {
+        if(!mapped.open_read(filename))
+            return false;
+        data = mapped.data;
+        N = mapped.size;
+        return true;
+    }
+
+    buffer.assign(std::istreambuf_iterator<char>(std::cin), {});
+    data = buffer.data();
+    N = buffer.size();
+    return !std::cin.bad();
+}
+
+// Write data to a file, or to standard output when 'filename' is null
+bool write_output(const char* filename, char* data, uint64_t N) {
+    if(filename)
+        return write_mapped(filename, data, N);
+    STAT_PHASE(PHASE_IO);
+    std::cout.write(data, N);
+    std::cout.flush();
+    return (bool)std::cout;
+}
+
+// Report a failed decompression. Huffman data compressed with a dictionary
+// that isn't given is reported as such rather than with 'message'.
+void decompress_error(const std::string& codecName,
+        const CodecOptions& options, char* data, uint64_t N,
+        const char* message) {
+    std::string problem;
+    if(codecName == "huffman")
+        problem = check_huffman_dictionary(options, data, N);
+    std::cerr << (problem.empty() ? message : problem) << std::endl;
+}
+
+int main (int argc, char *argv[]) {
+    STAT_START("Compressor");
+    if(argc < 2) {
+        usage();
+        return -1;
+    }
+    std::string command = argv[1];
+    if(command != "compress" && command != "decompress"
+            && command != "verify" && command != "train") {
+        std::cerr << "unknown command: " << command << std::endl;
+        usage();
+        return -1;
+    }
+
+    CodecOptions options;
+    std::string codecName = "huffman";
+    std::string coderName = "huffman";
+    const char* outname = nullptr;
+    bool streaming = false;
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int opt;
+    optind = 2;
+    while((opt = getopt(argc, argv, "b:c:D:e:i:l:mo:pr:st:w:W:xz:")) != -1) {
+        switch(opt) {
+            case 'b': options.blockSize = atoll(optarg) * 1024; break;
+            case 'c': codecName = optarg; break;
+            case 'D': options.dictionary = optarg; break;
+            case 'e': coderName = optarg; break;
+            case 'i': options.streams = atoi(optarg); break;
+            case 'l': options.maxCodeLen = atoi(optarg); break;
+            case 'm': streaming = true; break;
+            case 'o': outname = optarg; break;
+            case 'p': options.primed = true; break;
+            case 'r': options.rescaleAt = atoi(optarg); break;
+            case 's': options.shared = true; break;
+            case 't': options.threads = std::max(1, atoi(optarg)); break;
+            case 'w': options.window = atoll(optarg); break;
+            case 'W': options.lzWindowBits = atoi(optarg); break;
+            case 'x': options.contexts = true; break;
+            case 'z': options.lzLevel = atoi(optarg); break;
+            default: usage(); return -1;
+        }
+    }
+    if(command == "train") {
+        if(optind >= argc || !outname) {
+            std::cerr << "training needs sample files and an output file"
+                      << std::endl;
+            return -1;
+        }
+        std::string error = check_huffman_options(options, false);
+        if(!error.empty()) {
+            std::cerr << error << std::endl;
+            return -1;
+        }
+        std::vector<std::string> samples(argv + optind, argv + argc);
+        if(!train_huffman_dictionary(samples, outname, options.maxCodeLen)) {
+            std::cerr << "error training dictionary" << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    const char* filename = optind < argc ? argv[optind] : nullptr;
+    if(filename && !strcmp(filename, "-")) filename = nullptr;
+    if(outname && !strcmp(outname, "-")) outname = nullptr;
+
+    if(!parse_entropy_coder(coderName, options.coder)) {
+        std::cerr << "unknown entropy coder: " << coderName << std::endl;
+        return -1;
+    }
+    std::string error = check_huffman_options(options, streaming);
+    if(!error.empty()) {
+        std::cerr << error << std::endl;
+        return -1;
+    }
+    if(options.rescaleAt < 512 || options.rescaleAt > 1 << 30) {
+        std::cerr << "rescale weight must be between 512 and " << (1 << 30)
+                  << std::endl;
+        return -1;
+    }
+    if(codecName == "fgk" && streaming && options.blockSize > 0) {
+        std::cerr << "FGK segments are not supported when streaming"
+                  << std::endl;
+        return -1;
+    }
+    if(streaming && command == "verify") {
+        std::cerr << "verify can't be combined with -m" << std::endl;
+        return -1;
+    }
+    if(streaming && codecName == "huffman" && (!filename || !outname)) {
+        std::cerr << "streaming huffman needs an input and an output file"
+                  << std::endl;
+        return -1;
+    }
+
+    Codec* codec = make_codec(codecName, options);
+    if(!codec) {
+        if(codecName == "huffman" && !options.dictionary.empty())
+            std::cerr << "error loading dictionary " << options.dictionary
+                      << std::endl;
+        else
+            std::cerr << "unknown codec: " << codecName << std::endl;
+        return -1;
+    }
+
+    int status = 0;
+    if(streaming) {
+        std::ifstream ifs;
+        std::ofstream ofs;
+        if(filename) ifs.open(filename, std::ios::binary);
+        if(outname) ofs.open(outname, std::ios::out | std::ios::binary);
+        std::istream& is = filename ? ifs : std::cin;
+        std::ostream& os = outname ? ofs : std::cout;
+        if(!is || !os) {
+            std::cerr << "error opening file" << std::endl;
+            status = -1;
+        } else if(command == "compress" && !codec->compress(is, os)) {
+            std::cerr << "error compressing file" << std::endl;
+            status = -1;
+        } else if(command == "decompress" && !codec->decompress(is, os)) {
+            // The header is enough to tell if a dictionary is missing. Only
+            // Huffman files have one, and they always come from a named file.
+            char header[32];
+            is.clear();
+            is.seekg(0, is.beg);
+            is.read(header, sizeof(header));
+            decompress_error(codecName, options, header, is.gcount(),
+                    "error decompressing file");
+            status = -1;
+        }
+
+        delete codec;
+        return status;
+    }
+
+    MappedFile mapped;
+    std::vector<char> buffer;
+    char* data;
+    uint64_t N;
+    if(!read_input(filename, mapped, buffer, data, N)) {
+        std::cerr << "error opening file" << std::endl;
+        delete codec;
+        return -1;
+    }
+
+    if(command == "compress") {
+        std::vector<char>* encoded = codec->compress(data, N);
+        if(!write_output(outname, encoded->data(), encoded->size())) {
+            std::cerr << "error writing file" << std::endl;
+            status = -1;
+        }
+        delete encoded;
+    } else if(command == "decompress") {
+        std::vector<char>* decoded = codec->decompress(data, N);
+        if(!decoded) {
+            std::string message = "not a compressed " + codecName + " file";
+            decompress_error(codecName, options, data, N, message.c_str());
+            status = -1;
+        } else if(!write_output(outname, decoded->data(), decoded->size())) {
+            std::cerr << "error writing file" << std::endl;
+            status = -1;
+        }
+        delete decoded;
+    } else {
+        std::vector<char>* encoded = codec->compress(data, N);
+        std::vector<char>* decoded = codec->decompress(encoded->data(),
+                encoded->size());
+
+        bool matching = decoded && decoded->size() == N
+            && (N == 0 || !memcmp(data, decoded->data(), N));
+        std::cout << codecName << ": " << N << "B -> " << encoded->size()
+                  << "B, " << (matching ? "files match" : "MISMATCH")
+                  << std::endl;
+        if(!matching) status = 1;
+
+        delete encoded;
+        delete decoded;
+    }
+
+    delete codec;
+    return status;
+}
@@ -15,378 +15,965 @@
 // This file (when supplied with a source file as the first argument) will
 // encode it using this dynamic huffman algorithm, and write it to file. The 
 // file has the name "compr_fgk.dat". Then the file will be decoded and written
-// to disk again as "orig_fgk.dat". We can diff the original source file with
-// "orig_huffman.dat" to ensure the process has not lost any data.
+// to disk again as "orig_fgk.txt". We can diff the original source file with
+// "orig_fgk.txt" to ensure the process has not lost any data.
+//
+// With "-m" the files are streamed through a chunk at a time instead of being
+// held in memory, so memory use stays bounded no matter how large the input.
+// "-r <weight>" halves all weights whenever the total reaches that weight
+// (2^30 by default, which keeps the weights from overflowing), and
+// "-w <symbols>" starts the tree over after every window of that many
+// symbols. Both let the codes follow data whose statistics change. They are
+// stored in a small header ahead of the bitstream, so the decoder follows
+// them without being told.
+//
+// "-b <KiB>" cuts the file into segments of that size, each coded from its
+// own fresh tree so they can be encoded and decoded on separate threads
+// ("-t <threads>"), and decoding can start at any segment. A header and an
+// index of segment sizes come first. Since every segment starts without any
+// knowledge of the data, "-p" primes each tree with the byte frequencies of
+// the whole file, which are stored in the header.
+//
+// Built with CODEC_LIBRARY defined, main() is left out and the codec goes into
+// libcodec.a instead, behind the interface in Codec.h.
 
 #include <bits/stdc++.h>
+#include <unistd.h>
 
-// Representation of a node in the Huffman tree
-struct TreeNode {
-    char c;
-    int freq;
-    int order;
+#include "BitIO.h"
+#include "Codec.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
 
-    TreeNode* left = nullptr;
-    TreeNode* right = nullptr;
-    TreeNode* parent = nullptr;
-    
-    bool zeroNode;
-    bool rootNode;
-    bool leafNode = 1;
+namespace fgk {
 
-    TreeNode(char c, int f, int order, TreeNode* parent, bool zero, bool root)
-        : c(c), freq(f), order(order), parent(parent), zeroNode(zero), rootNode(root) {};
-};
+// Nodes are referred to by their index in the tree's node pool
+typedef uint16_t NodeId;
+const NodeId NO_NODE = UINT16_MAX;
 
+// The end of the data is written as the zero node's code, END_TEXT and a 1
+// bit. A new symbol that happens to be the byte END_TEXT is followed by a 0
+// bit instead, so every byte value can appear in the data.
 const char END_TEXT = -1;
 
-// Start from node in the tree and follow path to root. Reversing this order
-// gives us the huffman code for the given symbol.
-std::string genCode(TreeNode* node) {
-    std::string code = "";
-    while(!node->rootNode) {
-        code += (node->parent->right == node) ? "1" : "0";
-        node = node->parent;
+// Every symbol and the zero node as leaves, plus the internal nodes above them
+const int MAX_NODES = 2 * 257 - 1;
+
+// Number of bits resolved by a single lookup in the decoder's table
+const int LOOKUP_BITS = 8;
+
+// Entry in the decode table: the node reached by following the looked up
+// bits down from the root, and how many of them it took. The walk stops early
+// at a leaf. A length of 0 marks an entry that has to be worked out again.
+struct DecodeEntry {
+    NodeId node;
+    unsigned char len;
+};
+
+// The nodes of one weight always sit next to each other in the node order.
+// The leader is the first of them, which is the node any of them has to be
+// swapped with before its weight can go up.
+struct WeightBlock {
+    int leader;
+};
+
+// How the tree forgets old statistics. Once the root weight reaches
+// 'rescaleAt', all weights are halved so recent symbols count for more, which
+// also keeps the weights (and so the depth of the tree) bounded. With a
+// 'window', the tree starts over from scratch after that many symbols. The
+// decoder must use the same policy as the encoder.
+struct AdaptPolicy {
+    int rescaleAt = 1 << 30;
+    uint64_t window = 0;
+};
+
+struct FGKTree;
+void build_tree(FGKTree* tree, const int* weights);
+
+// The adaptive Huffman tree. The encoder and decoder both start from a lone
+// zero node (or a tree built from given starting weights) and apply the same
+// updates, so they stay in lockstep.
+//
+// The nodes are stored as one array per field, indexed by node, so walking
+// the tree only touches the few KiB of links it needs rather than whole node
+// records. Nodes are never removed, so adding one is just taking the next
+// index. The root is always node 0.
+struct FGKTree {
+    // Weight of each node
+    int freq[MAX_NODES];
+
+    // Position in the node order, 0 being the root. Weights never increase
+    // along the order, which is what keeps the tree a Huffman tree.
+    uint16_t order[MAX_NODES];
+
+    // Links between nodes. child[0] is the left ('0') branch and child[1]
+    // the right ('1') branch, both NO_NODE for leaves.
+    NodeId parent[MAX_NODES];
+    NodeId child[2][MAX_NODES];
+
+    // Block of nodes sharing this node's weight
+    uint16_t block[MAX_NODES];
+
+    // Symbol of each leaf
+    char symbol[MAX_NODES];
+
+    int size = 0;
+
+    // Nodes by their position in the order
+    NodeId byOrder[MAX_NODES];
+
+    // Weight blocks, and the ones not in use
+    WeightBlock blocks[MAX_NODES];
+    uint16_t freeBlocks[MAX_NODES];
+    int numFree = 0;
+
+    NodeId zeroNode;
+
+    // Node of each symbol seen so far
+    NodeId symbolNode[256];
+
+    // Decode table for the top LOOKUP_BITS levels of the tree, only kept up
+    // to date when 'lookup' is set. Entries are filled in when first used,
+    // and cleared again when the part of the tree they cover changes.
+    bool lookup = false;
+    DecodeEntry table[1 << LOOKUP_BITS];
+
+    AdaptPolicy policy;
+
+    // Weight of each symbol in the starting tree, 0 for symbols not in it
+    int startWeights[256] = {0};
+
+    // Symbols coded since the tree was last reset
+    uint64_t coded;
+
+    FGKTree(const AdaptPolicy& policy = AdaptPolicy(),
+            const int* start = nullptr) : policy(policy) {
+        if(start)
+            memcpy(startWeights, start, sizeof(startWeights));
+        reset();
+    }
+
+    // Go back to the starting tree. Without starting weights the root node
+    // is the initial zero node.
+    void reset() {
+        coded = 0;
+        build_tree(this, startWeights);
+    }
+
+    // Nodes are added at the end of the order, which is always where the
+    // zero node and its block are
+    NodeId new_node(char c, NodeId p) {
+        freq[size] = 0;
+        order[size] = size;
+        parent[size] = p;
+        child[0][size] = child[1][size] = NO_NODE;
+        symbol[size] = c;
+        if(size > 0) block[size] = block[byOrder[size - 1]];
+        byOrder[size] = size;
+        return size++;
+    }
+
+    uint16_t new_block(int leader) {
+        uint16_t b = freeBlocks[--numFree];
+        blocks[b].leader = leader;
+        return b;
+    }
+
+    bool leaf(NodeId node) {
+        return child[0][node] == NO_NODE;
+    }
+};
+
+// Start from node in the tree and follow path to root. Each step up adds a
+// bit above the ones collected so far, so the step down from the root ends
+// up as the top bit and the code reads in the right order without reversing.
+//
+// Weights along a path grow at least as fast as the Fibonacci numbers, so no
+// path gets anywhere near 64 steps while the root weight fits in an int.
+Code genCode(FGKTree* tree, NodeId node) {
+    Code code = {0, 0};
+    while(node != 0) {
+        NodeId parent = tree->parent[node];
+        code.bits |= (uint64_t)(tree->child[1][parent] == node) << code.len++;
+        node = parent;
     }
-    std::reverse(code.begin(), code.end());
     return code;
 }
 
-// Check throughout the tree to ensure that the sibling property is maintained.
-// If we determine our node is out of order, return the replacement spot for it
-TreeNode* new_spot(TreeNode* node, TreeNode* root) {
-    TreeNode* temp = node;
+// Clear the decode table entries whose walk passes through the place of a
+// node in the tree. A node less than LOOKUP_BITS deep covers all entries
+// starting with its code; deeper nodes are below where the walks stop.
+void invalidate(FGKTree* tree, NodeId node) {
+    if(!tree->lookup) return;
 
-    if(root->freq > temp->freq && !root->leafNode) {
-        TreeNode* left = new_spot(temp, root->left);
-        if(left)
-            temp = left;
-        TreeNode* right = new_spot(temp, root->right);
-        if(right)
-            temp = right;
-    }
-    else if(root->freq == temp->freq && root->order > temp->order)
-        temp = root;
+    Code code = genCode(tree, node);
+    if(code.len > LOOKUP_BITS) return;
 
-    if(temp == node)    // No change needs to be made to the tree
-        return nullptr;
-    return temp;
+    STAT_ADD(FGK_TABLE_INVALIDATIONS, 1);
+    int shift = LOOKUP_BITS - code.len;
+    DecodeEntry* first = tree->table + (code.bits << shift);
+    for(int i=0; i<(1 << shift); i++)
+        first[i].len = 0;
 }
 
-// Update frequencies from node up the the root of the Huffman tree
-void update_freq(TreeNode* node, TreeNode* root) {
-    while(!node->rootNode) {
-        // Check for sibling property
-        TreeNode* replacement = new_spot(node,root);
+// Exchange the places of two nodes of the same weight, along with their
+// subtrees, in both the tree and the node order
+void swap_nodes(FGKTree* tree, NodeId a, NodeId b) {
+    if(a == b) return;
+    STAT_ADD(FGK_SWAPS, 1);
+
+    invalidate(tree, a);
+    invalidate(tree, b);
+
+    std::swap(tree->order[a], tree->order[b]);
+    tree->byOrder[tree->order[a]] = a;
+    tree->byOrder[tree->order[b]] = b;
+
+    // Point each parent at the other node. Siblings just trade branches.
+    NodeId pa = tree->parent[a], pb = tree->parent[b];
+    int sideA = tree->child[1][pa] == a;
+    int sideB = tree->child[1][pb] == b;
+    tree->child[sideA][pa] = b;
+    tree->child[sideB][pb] = a;
+    tree->parent[a] = pb;
+    tree->parent[b] = pa;
+}
 
-        // Do we need to make adjustments to the tree?
-        if(replacement && node->parent != replacement) {
-            // Ensure order is maintained after swapping
-            std::swap(node->order, replacement->order);
-            
-            // Check if siblings
-            TreeNode* parent = node->parent;
-            if((parent->left == node && parent->right == replacement)
-                    || (parent->left == replacement && parent->right == node)) {
-
-                TreeNode* temp = parent->left;
-                parent->left = parent->right;
-                parent->right = temp;
-
-            } else {
-                // Swap pointers
-                if(node->parent->left == node)
-                    node->parent->left = replacement;
-                else
-                    node->parent->right = replacement;
-                if(replacement->parent->left == replacement)
-                    replacement->parent->left = node;
-                else
-                    replacement->parent->right = node;
-
-                std::swap(node->parent, replacement->parent);
-            }
+// Add one to the weight of a node at the front of its block. It moves from
+// its block to the one just ahead of it in the order, or to a new block if
+// no node ahead has the new weight.
+void increment(FGKTree* tree, NodeId node) {
+    int pos = tree->order[node];
+
+    // The next node in the order leads the old block, if there is one left
+    int next = pos + 1;
+    if(next < tree->size && tree->freq[tree->byOrder[next]] == tree->freq[node])
+        tree->blocks[tree->block[node]].leader = next;
+    else
+        tree->freeBlocks[tree->numFree++] = tree->block[node];
+
+    tree->freq[node]++;
+    NodeId ahead = pos > 0 ? tree->byOrder[pos - 1] : NO_NODE;
+    if(ahead != NO_NODE && tree->freq[ahead] == tree->freq[node])
+        tree->block[node] = tree->block[ahead];
+    else
+        tree->block[node] = tree->new_block(pos);
+}
 
+// Build the tree afresh, with a leaf for each symbol of non-zero weight and
+// the zero node.
+//
+// The tree is built the Huffman way, by joining the two lightest nodes left
+// until one remains. Nodes come out of that in order of weight, so giving
+// them places in the order from the back as they are taken yields a tree
+// with the sibling property. The zero node weighs nothing, so it is taken
+// first and ends up last, where new nodes are added. Nodes are renumbered by
+// place, which keeps the root at node 0.
+void build_tree(FGKTree* tree, const int* weights) {
+    STAT_PHASE(PHASE_TREE);
+    struct Item { int freq; char c; int kids[2]; };
+    std::vector<Item> items;
+
+    items.push_back({0, 0, {-1, -1}});
+    for(int s=0; s<256; s++)
+        if(weights[s] > 0)
+            items.push_back({weights[s], (char)s, {-1, -1}});
+    std::stable_sort(items.begin(), items.end(),
+        [](const Item& a, const Item& b) { return a.freq < b.freq; });
+
+    // Leaves are taken in sorted order, joined nodes in the order they were
+    // made, which is also sorted
+    int leaves = items.size();
+    int n = 2*leaves - 1;
+    std::vector<int> place(n);
+    int nextLeaf = 0, nextJoined = leaves, nextPlace = n;
+    auto take = [&]() {
+        bool leaf = nextJoined == (int)items.size() || (nextLeaf < leaves
+            && items[nextLeaf].freq <= items[nextJoined].freq);
+        int i = leaf ? nextLeaf++ : nextJoined++;
+        place[i] = --nextPlace;
+        return i;
+    };
+    while(nextPlace > 1) {
+        int a = take(), b = take();
+        items.push_back({items[a].freq + items[b].freq, 0, {a, b}});
+    }
+    place[n - 1] = --nextPlace;
+
+    // Lay the nodes out in their places
+    for(int s=0; s<256; s++)
+        tree->symbolNode[s] = NO_NODE;
+    tree->size = n;
+    tree->parent[0] = NO_NODE;
+    for(int i=0; i<n; i++) {
+        NodeId node = place[i];
+        tree->freq[node] = items[i].freq;
+        tree->order[node] = node;
+        tree->byOrder[node] = node;
+        tree->symbol[node] = items[i].c;
+        for(int k=0; k<2; k++) {
+            int kid = items[i].kids[k];
+            tree->child[k][node] = kid < 0 ? NO_NODE : place[kid];
+            if(kid >= 0) tree->parent[place[kid]] = node;
         }
+        if(i < leaves && i > 0)
+            tree->symbolNode[(unsigned char)items[i].c] = node;
+    }
+    tree->zeroNode = place[0];
+
+    // Blocks are runs of the same weight along the order
+    tree->numFree = 0;
+    for(int i=MAX_NODES-1; i>=0; i--)
+        tree->freeBlocks[tree->numFree++] = i;
+    for(int node=0; node<n; node++) {
+        if(node > 0 && tree->freq[node] == tree->freq[node - 1])
+            tree->block[node] = tree->block[node - 1];
+        else
+            tree->block[node] = tree->new_block(node);
+    }
+
+    memset(tree->table, 0, sizeof(tree->table));
+}
 
-        // Update frequency and move up tree
-        node->freq++;
-        node = node->parent;
+// Halve the weight of every symbol, keeping it at least 1, and build the tree
+// again from those weights
+void rescale(FGKTree* tree) {
+    STAT_ADD(FGK_RESCALES, 1);
+    int weights[256];
+    for(int s=0; s<256; s++) {
+        NodeId node = tree->symbolNode[s];
+        weights[s] = node == NO_NODE ? 0 : (tree->freq[node] + 1) / 2;
     }
-    node->freq++;
+    build_tree(tree, weights);
 }
 
-// Dynamically encode data to binary format
-std::vector<char>* encode(char* data, int N) {
-    std::vector<char>* output = new std::vector<char>;
-    TreeNode* hfTree = new TreeNode(0,0,INT_MAX,nullptr,1,1);
+// Update frequencies from node up the the root of the Huffman tree. Each node
+// on the way is first swapped to the front of its block, so the sibling
+// property holds once its weight goes up.
+void update_freq(FGKTree* tree, NodeId node) {
+    STAT_ADD(FGK_UPDATES, 1);
+    while(node != NO_NODE) {
+        STAT_ADD(FGK_UPDATE_LEVELS, 1);
+        NodeId parent = tree->parent[node];
+        int leader = tree->blocks[tree->block[node]].leader;
+
+        if(tree->byOrder[leader] == parent) {
+            // Only the sibling of the zero node weighs as much as its parent.
+            // Right behind the parent, they can both move up together.
+            // Otherwise swap it with the node there first, which takes it
+            // out from under the parent, and try again.
+            NodeId next = tree->byOrder[leader + 1];
+            if(next != node) {
+                swap_nodes(tree, node, next);
+                continue;
+            }
+            increment(tree, parent);
+            increment(tree, node);
+            node = tree->parent[parent];
+        } else {
+            swap_nodes(tree, node, tree->byOrder[leader]);
+            increment(tree, node);
+            node = tree->parent[node];
+        }
+    }
 
-    // Root node is initial zero node
-    TreeNode* zeroNode = hfTree;
+    // Forget old statistics as the policy says
+    if(tree->policy.window && ++tree->coded == tree->policy.window) {
+        STAT_ADD(FGK_RESETS, 1);
+        tree->reset();
+    }
+    else if(tree->freq[0] >= tree->policy.rescaleAt)
+        rescale(tree);
+}
 
-    // Lookup table to find the node associated with each symbol
-    std::map<char,TreeNode*> symbolTable;
+// Create 2 new leaf nodes from the current zero node. The new zero node will
+// be on the left, while the new symbol node will be on the right.
+//
+// Returns the new symbol node, with a weight of zero for update_freq() to
+// bring up to one.
+NodeId add_symbol(FGKTree* tree, char c) {
+    STAT_ADD(FGK_NEW_SYMBOLS, 1);
+    NodeId zeroNode = tree->zeroNode;
+    invalidate(tree, zeroNode);
+    NodeId right = tree->new_node(c,zeroNode);
+    NodeId left = tree->new_node(0,zeroNode);
+
+    // Old zero node converted to internal node
+    tree->child[0][zeroNode] = left;
+    tree->child[1][zeroNode] = right;
+
+    // Update entry in the sybol table to point to node in tree
+    tree->symbolNode[(unsigned char)c] = right;
+    tree->zeroNode = left;
+
+    return right;
+}
 
-    char buffer = 0;
-    int counter = 0;
-    int dataPos = 0;
-    while(dataPos < N) {
-        char cur = data[dataPos++];
+// Dynamically encode data to binary format, appending it to the writer's
+// output. The writer keeps any bits that don't fill a whole word between
+// calls, so that a file can be encoded a chunk at a time.
+void encode(FGKTree* tree, BitWriter* writer, char* data, uint64_t N) {
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    for(uint64_t dataPos=0; dataPos<N; dataPos++) {
+        char cur = data[dataPos];
 
         // Does the current sybol already exist in the tree?
-        if(symbolTable[cur]) {
-            // Generate the code for this symbol
-            std::string code = genCode(symbolTable[cur]);
-    
-            // Write code to output
-            for(char c:code) {
-                buffer |= (c=='1');
-                counter++;
-                
-                if(counter == 8) {
-                    output->push_back(buffer);
-                    counter = 0;
-                    buffer = 0;
-                }
-
-                buffer <<= 1;
-            }
+        NodeId node = tree->symbolNode[(unsigned char)cur];
+        if(node != NO_NODE) {
+            // Generate the code for this symbol and write it to output
+            Code code = genCode(tree, node);
+            writer->put(code.bits, code.len);
+            STAT_ADD(CODE_BITS, code.len);
             
             // Perform any operations on the tree to maintain sibling property
-            update_freq(symbolTable[cur], hfTree);
+            update_freq(tree, node);
         }
         else {
             // Get code of zero node followed by full symbol
-            std::string code = genCode(zeroNode);
-            for(int i=7; i>=0; i--)
-                code += (cur & (1<<i)) ? "1" : "0";
-    
-            // Write code to output
-            for(char c:code) {
-                buffer |= (c=='1');
-                counter++;
-                
-                if(counter == 8) {
-                    output->push_back(buffer);
-                    counter = 0;
-                    buffer = 0;
-                }
-
-                buffer <<= 1;
-            }
-
-            // Create 2 new leaf nodes from the current zero node.
-            // The new zero node will be on the left, while the new symbol node
-            // will be on the right.
-            // std::cout<<"Splitting zero node"<<std::endl;
-            TreeNode* left = new TreeNode(0,0,zeroNode->order - 2,zeroNode,1,0);  
-            TreeNode* right = new TreeNode(cur,1,zeroNode->order - 1,zeroNode,0,0);  
-            TreeNode* parent = zeroNode;
-
-            // Old zero node converted to internal node
-            zeroNode->leafNode = 0;
-            zeroNode->zeroNode = 0;
-            zeroNode->left = left;
-            zeroNode->right = right;
-
-            // Update entry in the sybol table to point to node in tree
-            symbolTable[cur] = right;
-            zeroNode = left;
+            Code code = genCode(tree, tree->zeroNode);
+            writer->put(code.bits, code.len);
+            writer->put((unsigned char)cur, 8);
+            if(cur == END_TEXT)
+                writer->put(0, 1);
+            STAT_ADD(CODE_BITS, code.len + 8 + (cur == END_TEXT));
 
             // Perform any operations on the tree to maintain sibling property
-            update_freq(parent, hfTree);
+            update_freq(tree, add_symbol(tree, cur));
         }
     }
+}
 
-    // Flush remaining buffer
-    output->push_back(buffer);
+// Mark the end of the data
+void encode_end(FGKTree* tree, BitWriter* writer) {
+    Code code = genCode(tree, tree->zeroNode);
+    writer->put(code.bits, code.len);
+    writer->put((unsigned char)END_TEXT, 8);
+    writer->put(1, 1);
+}
 
-    // Deallocate tree
-    std::stack<TreeNode*> S;
-    S.push(hfTree);
-    while(!S.empty()) {
-        TreeNode* cur = S.top();
-        S.pop();
+const char STREAM_MAGIC[4] = {'F','G','K','A'};
+const int STREAM_HEADER_SIZE = 16;
+
+// A single bitstream starts with the adaptation policy, since the decoder has
+// to rescale and reset its tree at exactly the same points:
+//    4 bytes   magic "FGKA"
+//    4 bytes   rescale weight
+//    8 bytes   window in symbols, 0 for none
+void write_stream_header(std::vector<char>* output, const AdaptPolicy& policy) {
+    output->insert(output->end(), STREAM_MAGIC, STREAM_MAGIC + 4);
+    put_int(output, policy.rescaleAt, 4);
+    put_int(output, policy.window, 8);
+}
 
-        if(cur->left) S.push(cur->left);
-        if(cur->right) S.push(cur->right);
+// Returns false if it is not the header of a single bitstream
+bool read_stream_header(char* buffer, uint64_t N, AdaptPolicy& policy) {
+    if(N < STREAM_HEADER_SIZE || memcmp(buffer, STREAM_MAGIC, 4))
+        return false;
+    policy.rescaleAt = get_int(buffer + 4, 4);
+    policy.window = get_int(buffer + 8, 8);
+    return policy.rescaleAt >= 512 && policy.rescaleAt <= 1 << 30;
+}
 
-        delete cur;
-    }
+// Dynamically encode a whole buffer to binary format, terminated by END_TEXT
+std::vector<char>* encode(char* data, uint64_t N, const AdaptPolicy& policy) {
+    std::vector<char>* output = new std::vector<char>;
+    write_stream_header(output, policy);
+    output->resize(STREAM_HEADER_SIZE + N + 16);
+    FGKTree tree(policy);
+    BitWriter writer(output);
+    writer.pos = STREAM_HEADER_SIZE;
+
+    encode(&tree, &writer, data, N);
+    encode_end(&tree, &writer);
+    writer.flush();
     
     return output;
 }
 
-// Dynamically decode data from binary format
-std::vector<char>* decode(char* data, int N) {
-    std::vector<char>* output = new std::vector<char>;
-    TreeNode* hfTree = new TreeNode(0,0,INT_MAX,nullptr,1,1);
-
-    // Root node is initial zero node
-    TreeNode* zeroNode = hfTree;
-
-    // Lookup table to find the node associated with each symbol
-    std::map<char,TreeNode*> symbolTable;
-
-    char buffer = data[0];
-    int bitIdx = 7;
-    int dataPos = 0;
-    while(dataPos < N) {
+// Dynamically decode data from binary format, until END_TEXT is found or
+// 'limit' bytes have been added to output. 'ended' is set once END_TEXT is
+// found, and left alone when the data runs out before it.
+//
+// Returns false once the end of the data has been reached.
+bool decode(FGKTree* tree, BitReader* in, std::vector<char>* output,
+        uint64_t limit, bool& ended) {
+    STAT_PHASE(PHASE_DECODE);
+    uint64_t start = output->size();
+    while(output->size() < limit) {
         // Start from root of Huffman tree and traverse downwards until we 
         // reach a leaf node. We traverse left for every '0' we read in the
-        // binary, and right for every '1'.
-        TreeNode* cur = hfTree;
-        while(!cur->leafNode) {
-            if(buffer & (1<<bitIdx--))
-                cur = cur->right;
-            else
-                cur = cur->left;
-
-            // Finished with this byte
-            if(bitIdx < 0) {
-                bitIdx = 7;
-                buffer = data[++dataPos];
+        // binary, and right for every '1'. The first LOOKUP_BITS levels are
+        // usually covered by a single table lookup.
+        NodeId cur = 0;
+        if(!tree->leaf(cur)) {
+            uint64_t bits = in->peek(LOOKUP_BITS);
+            DecodeEntry& e = tree->table[bits];
+            if(e.len == 0) {
+                STAT_ADD(FGK_TABLE_FILLS, 1);
+                e.node = cur;
+                while(e.len < LOOKUP_BITS && !tree->leaf(e.node))
+                    e.node = tree->child[bits >> (LOOKUP_BITS - 1 - e.len++) & 1]
+                                        [e.node];
             }
+            in->consume(e.len);
+            cur = e.node;
         }
+        while(!tree->leaf(cur))
+            cur = tree->child[in->bit()][cur];
 
         // Write the decoded character to output to buffer. If we ended on the
         // zero node, we read the next byte which will correspond to a new
         // character to be added to the tree.
         char temp = 0;
-        if(cur->zeroNode) {
+        if(cur == tree->zeroNode) {
             // Read next 8 bits
-            for(int i=0; i<8; i++) {
-                if(buffer&(1<<bitIdx--)) temp |= 1;
-                if(i<7) temp <<= 1;
-
-                // Finished with this byte
-                if(bitIdx < 0) {
-                    bitIdx = 7;
-                    buffer = data[++dataPos];
-                }
+            for(int i=0; i<8; i++)
+                temp = (temp << 1) | in->bit();
+            
+            // END_TEXT is followed by a bit telling the end apart from a
+            // byte of that value
+            if(temp == END_TEXT && (in->bit() || in->exhausted)) {
+                ended = !in->exhausted;
+                break;
             }
             
             // Create new leaf nodes. Same process as encoding
-            TreeNode* left = new TreeNode(0,0,zeroNode->order - 2,zeroNode,1,0);  
-            TreeNode* right = new TreeNode(temp,1,zeroNode->order - 1,zeroNode,0,0);  
-            cur = zeroNode;
-
-            // Convert old zero node into internal node
-            zeroNode->leafNode = 0;
-            zeroNode->zeroNode = 0;
-            zeroNode->left = left;
-            zeroNode->right = right;
-
-            // Update symbol table to point to entry in the tree
-            symbolTable[temp] = right;
-            zeroNode = left;
+            cur = add_symbol(tree, temp);
         }
         else {
             // The character already exists in the tree, so we can just output
             // it to the buffer.
-            temp = cur->c;    
+            temp = tree->symbol[cur];    
         }
 
-        // Check for encoded EOF character
-        if(temp == END_TEXT) return output;
+        // Check for data that ended without an end mark
+        if(in->exhausted) break;
 
         // Write to output buffer and update frequencies in the tree
         output->push_back(temp);
-        update_freq(cur,hfTree);
+        update_freq(tree, cur);
     }
 
-    // Deallocate tree
-    std::stack<TreeNode*> S;
-    S.push(hfTree);
-    while(!S.empty()) {
-        TreeNode* cur = S.top();
-        S.pop();
+    STAT_ADD(SYMBOLS_DECODED, output->size() - start);
+    return output->size() >= limit;
+}
+
+// Dynamically decode a whole buffer from binary format. Returns nullptr if
+// it is not a single FGK bitstream, or is cut short of its end mark.
+std::vector<char>* decode(char* data, uint64_t N) {
+    AdaptPolicy policy;
+    if(!read_stream_header(data, N, policy))
+        return nullptr;
+
+    std::vector<char>* output = new std::vector<char>;
+    FGKTree tree(policy);
+    BitReader in(data + STREAM_HEADER_SIZE, N - STREAM_HEADER_SIZE);
+    tree.lookup = true;
+
+    bool ended = false;
+    decode(&tree, &in, output, UINT64_MAX, ended);
+    if(!ended) {
+        delete output;
+        return nullptr;
+    }
+    return output;
+}
+
+// Encode a stream a chunk at a time, writing the output as it goes.
+// Returns the number of bytes read.
+uint64_t encode_stream(std::istream& is, std::ostream& os,
+        const AdaptPolicy& policy) {
+    FGKTree tree(policy);
+    std::vector<char> output;
+    write_stream_header(&output, policy);
+    output.resize(STREAM_HEADER_SIZE + CHUNK_SIZE + 16);
+    BitWriter writer(&output);
+    writer.pos = STREAM_HEADER_SIZE;
+
+    uint64_t total = encode_chunks(is, os, writer,
+        [&](char* data, uint64_t n) { encode(&tree, &writer, data, n); });
+
+    encode_end(&tree, &writer);
+    writer.flush();
+    STAT_PHASE(PHASE_IO);
+    os.write(output.data(), output.size());
+
+    return total;
+}
+
+// Decode a stream a chunk at a time, writing the output as it goes.
+// Returns false if it is not a single FGK bitstream, or is cut short of its
+// end mark.
+bool decode_stream(std::istream& is, std::ostream& os) {
+    char header[STREAM_HEADER_SIZE];
+    AdaptPolicy policy;
+    if(!is.read(header, STREAM_HEADER_SIZE)
+            || !read_stream_header(header, STREAM_HEADER_SIZE, policy))
+        return false;
+
+    FGKTree tree(policy);
+    BitReader in(is);
+    tree.lookup = true;
+
+    bool ended = false;
+    decode_chunks(os, [&](std::vector<char>* output) {
+        return decode(&tree, &in, output, CHUNK_SIZE, ended);
+    });
+    return ended;
+}
+
+const char MAGIC[4] = {'F','G','K','S'};
+
+// Settings of a segmented file, all stored in its header so the segments can
+// be decoded without being told how they were encoded
+struct SegmentHeader {
+    uint64_t length = 0;
+    uint64_t segmentSize = 0;
+    AdaptPolicy policy;
+    bool primed = false;
+    int weights[256] = {0};
+};
+
+void write_segment_header(std::vector<char>* output, SegmentHeader& header) {
+    output->insert(output->end(), MAGIC, MAGIC + 4);
+    put_int(output, header.length, 8);
+    put_int(output, header.segmentSize, 4);
+    put_int(output, header.policy.rescaleAt, 4);
+    put_int(output, header.policy.window, 8);
+    output->push_back(header.primed);
+    if(header.primed)
+        for(int s=0; s<256; s++)
+            output->push_back(header.weights[s]);
+}
+
+// Parse the header of a segmented file. Returns the number of bytes read, or
+// -1 if it is not a valid segmented file.
+int read_segment_header(char* buffer, uint64_t N, SegmentHeader& header) {
+    if(N < 29 || memcmp(buffer, MAGIC, 4)) return -1;
+
+    header.length = get_int(buffer + 4, 8);
+    header.segmentSize = get_int(buffer + 12, 4);
+    header.policy.rescaleAt = get_int(buffer + 16, 4);
+    header.policy.window = get_int(buffer + 20, 8);
+    header.primed = buffer[28];
+    if(header.segmentSize == 0 || header.policy.rescaleAt < 512
+            || header.policy.rescaleAt > 1 << 30)
+        return -1;
 
-        if(cur->left) S.push(cur->left);
-        if(cur->right) S.push(cur->right);
+    int pos = 29;
+    if(header.primed) {
+        if(N < 29 + 256) return -1;
+        for(int s=0; s<256; s++)
+            header.weights[s] = (unsigned char)buffer[pos++];
+    }
+    return pos;
+}
+
+// Starting weights for priming every segment's tree: the byte frequencies
+// of the whole input, scaled to fit in a byte. Symbols that occur keep a
+// weight of at least 1.
+void prime_weights(int* weights, char* data, uint64_t N) {
+    uint64_t freq[256] = {0};
+    for(uint64_t i=0; i<N; i++)
+        freq[(unsigned char)data[i]]++;
+    uint64_t most = *std::max_element(freq, freq + 256);
+    for(int s=0; s<256; s++)
+        weights[s] = freq[s] ? std::max<uint64_t>(1, freq[s] * 255 / most) : 0;
+}
+
+// Encode a file as independent segments on the pool's threads. Each segment
+// is a complete FGK bitstream, ending in END_TEXT, of 'segmentSize' bytes of
+// the input coded from a fresh (or primed) tree.
+std::vector<char>* compress_segments(char* data, uint64_t N,
+        SegmentHeader& header, ThreadPool& pool) {
+    uint64_t segmentSize = header.segmentSize;
+    uint64_t nsegments = (N + segmentSize - 1) / segmentSize;
+
+    header.length = N;
+    if(header.primed)
+        prime_weights(header.weights, data, N);
+
+    std::vector<std::vector<char>*> segments(nsegments);
+    pool.parallel_for(nsegments, [&](int i) {
+        uint64_t size = std::min(segmentSize, N - i*segmentSize);
+        std::vector<char>* output = new std::vector<char>(size + 16);
+        FGKTree tree(header.policy, header.primed ? header.weights : nullptr);
+        BitWriter writer(output);
+
+        encode(&tree, &writer, data + i*segmentSize, size);
+        encode_end(&tree, &writer);
+        writer.flush();
+        segments[i] = output;
+    });
+
+    std::vector<char>* output = new std::vector<char>;
+    write_segment_header(output, header);
+
+    // Segment index, followed by the segments themselves
+    for(std::vector<char>* segment : segments)
+        put_int(output, segment->size(), 8);
+    for(std::vector<char>* segment : segments) {
+        output->insert(output->end(), segment->begin(), segment->end());
+        delete segment;
+    }
+
+    return output;
+}
 
-        delete cur;
+// Decode a segmented file, all segments at once on the pool's threads.
+// Returns nullptr if the data is not a valid segmented file.
+std::vector<char>* decompress_segments(char* buffer, uint64_t N,
+        ThreadPool& pool) {
+    SegmentHeader header;
+    int pos = read_segment_header(buffer, N, header);
+    if(pos < 0) return nullptr;
+
+    uint64_t segmentSize = header.segmentSize;
+    uint64_t nsegments = (header.length + segmentSize - 1) / segmentSize;
+    if((N - pos) / 8 < nsegments) return nullptr;
+    // Every byte takes at least a bit
+    if(header.length / 8 > N) return nullptr;
+
+    // Find where each segment starts from the index
+    std::vector<uint64_t> offsets(nsegments + 1);
+    offsets[0] = pos + 8*nsegments;
+    for(uint64_t i=0; i<nsegments; i++) {
+        offsets[i+1] = offsets[i] + get_int(buffer + pos + 8*i, 8);
+        if(offsets[i+1] < offsets[i] || offsets[i+1] > N) return nullptr;
     }
 
+    std::vector<char>* output = new std::vector<char>(header.length);
+    std::atomic<bool> ok{true};
+    pool.parallel_for(nsegments, [&](int i) {
+        uint64_t size = std::min(segmentSize, header.length - i*segmentSize);
+        FGKTree tree(header.policy, header.primed ? header.weights : nullptr);
+        tree.lookup = true;
+        BitReader in(buffer + offsets[i], offsets[i+1] - offsets[i]);
+
+        // A whole segment is decoded before its end mark is reached
+        std::vector<char> segment;
+        segment.reserve(size);
+        bool ended = false;
+        decode(&tree, &in, &segment, size, ended);
+        if(segment.size() != size)
+            ok = false;
+        else
+            memcpy(output->data() + i*segmentSize, segment.data(), size);
+    });
+
+    if(!ok) {
+        delete output;
+        return nullptr;
+    }
     return output;
 }
 
+// The FGK coder behind the common Codec interface. Segments are only used for
+// buffers; streams are always a single bitstream, so a codec set up for
+// segments refuses them rather than quietly writing something else.
+struct FGKCodec : Codec {
+    SegmentHeader format;
+    ThreadPool pool;
+
+    FGKCodec(const CodecOptions& options) : pool(options.threads) {
+        format.segmentSize = options.blockSize;
+        format.primed = options.primed;
+        format.policy.rescaleAt = options.rescaleAt;
+        format.policy.window = options.window;
+    }
+
+    std::vector<char>* compress(char* data, uint64_t N) {
+        SegmentHeader header = format;
+        return header.segmentSize > 0
+            ? compress_segments(data, N, header, pool)
+            : encode(data, N, format.policy);
+    }
+
+    std::vector<char>* decompress(char* data, uint64_t N) {
+        return N >= 4 && !memcmp(data, MAGIC, 4)
+            ? decompress_segments(data, N, pool)
+            : decode(data, N);
+    }
+
+    bool compress(std::istream& is, std::ostream& os) {
+        if(format.segmentSize > 0) return false;
+        encode_stream(is, os, format.policy);
+        return is.eof() && os;
+    }
+
+    // Segmented files fail the header check of a single bitstream
+    bool decompress(std::istream& is, std::ostream& os) {
+        if(format.segmentSize > 0) return false;
+        return decode_stream(is, os) && os;
+    }
+};
+
+} // namespace fgk
+
+Codec* new_fgk_codec(const CodecOptions& options) {
+    return new fgk::FGKCodec(options);
+}
+
+#ifndef CODEC_LIBRARY
+using namespace fgk;
+
+void usage() {
+    std::cerr << "usage: FGK [-r rescale weight] [-w window symbols] "
+                 "[-b segment KiB] [-p] [-t threads] [-m] <file>" << std::endl;
+}
+
 int main (int argc, char *argv[]) {
-    if(argc < 2) {
-        std::cerr << "no filename provided" << std::endl;
+    STAT_START("FGK");
+    // Segments are off unless a segment size is given
+    SegmentHeader format;
+    AdaptPolicy& policy = format.policy;
+    bool streaming = false;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:mpr:t:w:")) != -1) {
+        switch(opt) {
+            case 'b': format.segmentSize = atoll(optarg) * 1024; break;
+            case 'm': streaming = true; break;
+            case 'p': format.primed = true; break;
+            case 'r': policy.rescaleAt = atoi(optarg); break;
+            case 't': threads = std::max(1, atoi(optarg)); break;
+            case 'w': policy.window = atoll(optarg); break;
+            default: usage(); return -1;
+        }
+    }
+    if(streaming && format.segmentSize > 0) {
+        std::cerr << "segments are not supported when streaming" << std::endl;
         return -1;
     }
-    
-    // Open file
-    std::ifstream ifs(argv[1], std::ios::binary | std::ios::ate);
-    if(!ifs) {
-        std::cerr << "error opening file" << std::endl;
+    if(format.primed && format.segmentSize == 0) {
+        std::cerr << "priming needs segments" << std::endl;
+        return -1;
+    }
+    if(format.segmentSize >= 1ULL << 32) {
+        std::cerr << "segment size must be under 4 GiB" << std::endl;
+        return -1;
+    }
+    // Halving has to bring the root weight well under the threshold, even
+    // with every symbol at the minimum weight of 1
+    if(policy.rescaleAt < 512 || policy.rescaleAt > 1 << 30) {
+        std::cerr << "rescale weight must be between 512 and " << (1 << 30)
+                  << std::endl;
+        return -1;
+    }
+
+    if(optind >= argc) {
+        std::cerr << "no filename provided" << std::endl;
+        usage();
         return -1;
     }
+    char* filename = argv[optind];
+    
+    ThreadPool pool(threads);
+    uint64_t data_size, data_size2;
+    MappedFile input;
+    std::vector<char>* encoded = nullptr;
+    std::vector<char>* decoded = nullptr;
+    double encode_time, decode_time;
+    bool matching = true;
 
-    // Determine length
-    int data_size = ifs.tellg();
-    ifs.seekg(0, ifs.beg);
+    if(streaming) {
+        // Open file
+        std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+        if(!ifs) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
 
-    // Read data
-    char* buffer = new char[data_size+1];
-    ifs.read(buffer, data_size);
-    buffer[data_size] = END_TEXT; // Insert ASCII 3 as psuedo-sybol for EOF
-    ifs.close();
+        // Determine length
+        data_size = ifs.tellg();
+        ifs.seekg(0, ifs.beg);
 
-    std::cout << "Compressing file..." << std::endl;
+        std::cout << "Compressing file..." << std::endl;
 
+        // Encode file straight to disk
+        std::ofstream ofs("compr_fgk.dat", std::ios::out | std::ios::binary);
+        std::clock_t encode_start = std::clock();
+        encode_stream(ifs, ofs, policy);
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        data_size2 = ofs.tellp();
+        ofs.close();
 
-    // Encode file
-    std::clock_t encode_start = std::clock();
-    std::vector<char>* encoded = encode(buffer, data_size+1);
-    double encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        std::cout << "Decompressing file..." << std::endl;
 
-    std::cout << "Writing to disk..." << std::endl;
+        // Decode file straight to disk
+        ifs.close();
+        ifs.open("compr_fgk.dat", std::ios::in | std::ios::binary);
+        ofs.open("orig_fgk.txt", std::ios::out | std::ios::binary);
+        std::clock_t decode_start = std::clock();
+        bool decoded = decode_stream(ifs, ofs);
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+        ofs.close();
 
-    // Write compressed data to file
-    std::ofstream ofs("compr_fgk.dat", std::ios::out | std::ios::binary);
-    ofs.write(encoded->data(), encoded->size());
-    ofs.flush();
+        std::cout << "Testing files..." << std::endl;
 
-    // Open compressed file
-    ifs.open("compr_fgk.dat",
-            std::ios::in | std::ios::binary | std::ios::ate);
-    if(!ifs) {
-        std::cerr << "error opening file" << std::endl;
-        return -1;
-    }
+        // Check for inconsistencies
+        matching = decoded && files_match(filename, "orig_fgk.txt");
+    } else {
+        // Map the file into memory
+        if(!input.open_read(filename)) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+        data_size = input.size;
 
-    // Determine length
-    int data_size2 = ifs.tellg();
-    ifs.seekg(0, ifs.beg);
+        std::cout << "Compressing file..." << std::endl;
 
-    // Read data
-    char* buffer2 = new char[data_size2];
-    ifs.read(buffer2, data_size2);
-    ifs.close();
 
-    std::cout << "Decompressing file..." << std::endl; 
+        // Encode file
+        std::clock_t encode_start = std::clock();
+        encoded = format.segmentSize > 0
+            ? compress_segments(input.data, data_size, format, pool)
+            : encode(input.data, data_size, policy);
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        data_size2 = encoded->size();
 
-    // Decode file
-    std::clock_t decode_start = std::clock();
-    std::vector<char>* decoded = decode(buffer2, data_size2);
-    double decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
- 
+        std::cout << "Writing to disk..." << std::endl;
 
-    std::cout << "Testing files..." << std::endl;
+        // Write compressed data to file
+        if(!write_mapped("compr_fgk.dat", encoded->data(), data_size2)) {
+            std::cerr << "error writing file" << std::endl;
+            return -1;
+        }
 
-    // Check for inconsistencies
-    bool matching = true;
-    for(int i=0; i<data_size; i++) {
-        if(buffer[i] != (*decoded)[i]) {
-            std::cerr << "Mismatching character at pos:" << i << std::endl;
-            std::cerr << "Original: " << std::hex << buffer[i] << std::endl;
-            std::cerr << "Decoded: " << std::hex << (*decoded)[i] << std::endl;
+        std::cout << "Decompressing file..." << std::endl;
+
+        // Decode the compressed data still in memory
+        std::clock_t decode_start = std::clock();
+        decoded = format.segmentSize > 0
+            ? decompress_segments(encoded->data(), data_size2, pool)
+            : decode(encoded->data(), data_size2);
+        if(!decoded) {
+            std::cerr << "Invalid compressed file" << std::endl;
+            decoded = new std::vector<char>;
+        }
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+ 
 
+        std::cout << "Testing files..." << std::endl;
+
+        // Check for inconsistencies
+        if(decoded->size() != data_size)
             matching = false;
-            break;
+        for(uint64_t i=0; matching && i<data_size; i++) {
+            if(input.data[i] != (*decoded)[i]) {
+                std::cerr << "Mismatching character at pos:" << i << std::endl;
+                std::cerr << "Original: " << std::hex << input.data[i] << std::endl;
+                std::cerr << "Decoded: " << std::hex << (*decoded)[i] << std::endl;
+
+                matching = false;
+                break;
+            }
         }
+
+        // Write decoded file to disk
+        write_mapped("orig_fgk.txt", decoded->data(), decoded->size());
     }
 
     // Display results
@@ -411,19 +998,11 @@ int main (int argc, char *argv[]) {
         std::cout<<std::endl;
     }
 
-    // Write decoded file to disk
-    ofs.close();
-    ofs.open("orig_fgk.txt",
-            std::ios::out | std::ios::binary);
-    ofs.write(decoded->data(), decoded->size());
-    ofs.flush();
-    ofs.close();
-
     // Clean up
-    delete[] buffer;
-    delete[] buffer2;
     delete encoded;
     delete decoded;
 
     return 0;
 }
+
+#endif
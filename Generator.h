@@ -0,0 +1,206 @@
+// Generated Data
+//
+// The distributions of generator.cpp, shared with the benchmark so it can
+// make large inputs of realistic data. Each generator produces its data a
+// piece at a time from a Random, so the output only depends on the seed.
+// Numbers are drawn from mt19937_64, whose output is fixed by the standard,
+// and scaled here rather than with the library's distributions, which can
+// differ between implementations.
+
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <bits/stdc++.h>
+
+// Training text for the Markov model when none is given
+const char* const TRAINING_TEXT =
+    "The compressed file starts with a small header holding a magic number, "
+    "a version and the original length of the data. When the decoder reads "
+    "the header it can rebuild the code table before it looks at any of the "
+    "encoded symbols. Most files are text, and most text is made of a small "
+    "number of common words that appear again and again, with a long tail of "
+    "rare words that only show up once or twice. A good model of the data "
+    "gives short codes to the common symbols and longer codes to the rare "
+    "ones, so the average length of a code is close to the entropy of the "
+    "source. Adaptive methods learn the model as they go, while static "
+    "methods scan the whole file first and store the model in the header. "
+    "Neither is better in every case: static codes are cheaper to decode, "
+    "but adaptive codes can follow data whose statistics change from one "
+    "part of the file to the next. Database systems compress pages of rows "
+    "and columns, where the values in one column are often very similar to "
+    "each other, and the same few strings are repeated across many rows.\n";
+
+struct Random {
+    std::mt19937_64 rng;
+
+    Random(uint64_t seed) : rng(seed) {};
+
+    // Uniform integer in [0, n)
+    uint64_t below(uint64_t n) { return rng() % n; }
+
+    // Uniform real in [0, 1)
+    double real() { return (rng() >> 11) * (1.0 / (1ULL << 53)); }
+};
+
+// Draws from a fixed set of weights by binary search over their running sums
+struct Weighted {
+    std::vector<double> sums;
+
+    Weighted(const std::vector<double>& weights) {
+        double total = 0;
+        for(double w:weights)
+            sums.push_back(total += w);
+    }
+
+    int pick(Random& rnd) {
+        double x = rnd.real() * sums.back();
+        return std::upper_bound(sums.begin(), sums.end(), x) - sums.begin();
+    }
+};
+
+// Weights 1/rank^s for ranks 1..n
+inline std::vector<double> zipf_weights(int n, double s) {
+    std::vector<double> weights(n);
+    for(int r=0; r<n; r++)
+        weights[r] = 1 / std::pow(r + 1, s);
+    return weights;
+}
+
+// A source of generated data, produced a piece at a time
+struct Generator {
+    virtual ~Generator() {};
+
+    // Append some more data to 'out'
+    virtual void generate(std::string& out) = 0;
+};
+
+struct UniformGenerator : Generator {
+    Random& rnd;
+
+    UniformGenerator(Random& rnd) : rnd(rnd) {};
+
+    void generate(std::string& out) {
+        for(int i=0; i<4096; i++)
+            out.push_back(1 + rnd.below(254));
+    }
+};
+
+struct ZipfGenerator : Generator {
+    Random& rnd;
+    Weighted ranks;
+    unsigned char symbol[256];
+
+    // Which byte gets which rank is shuffled, so the common bytes aren't
+    // always 0, 1, 2 and so on
+    ZipfGenerator(Random& rnd, double s) : rnd(rnd),
+            ranks(zipf_weights(256, s)) {
+        for(int i=0; i<256; i++)
+            symbol[i] = i;
+        for(int i=255; i>0; i--)
+            std::swap(symbol[i], symbol[rnd.below(i + 1)]);
+    }
+
+    void generate(std::string& out) {
+        for(int i=0; i<4096; i++)
+            out.push_back(symbol[ranks.pick(rnd)]);
+    }
+};
+
+// Each next byte is drawn from the bytes that follow the last k bytes
+// somewhere in the training text, in proportion to how often they do
+struct MarkovGenerator : Generator {
+    Random& rnd;
+    int order;
+    std::string context;
+    std::unordered_map<std::string, std::string> followers;
+
+    MarkovGenerator(Random& rnd, const std::string& text, int order)
+            : rnd(rnd), order(order) {
+        // Wrap the text around, so every context has a follower
+        std::string wrapped = text
+            + text.substr(0, std::min<size_t>(order, text.size()));
+        for(size_t i=0; i<text.size(); i++)
+            followers[wrapped.substr(i, order)].push_back(wrapped[i + order]);
+        context = wrapped.substr(0, order);
+    }
+
+    void generate(std::string& out) {
+        for(int i=0; i<4096; i++) {
+            std::string& next = followers[context];
+            char c = next[rnd.below(next.size())];
+            out.push_back(c);
+            if(order > 0) {
+                context.erase(0, 1);
+                context.push_back(c);
+            }
+        }
+    }
+};
+
+struct LogGenerator : Generator {
+    Random& rnd;
+    uint64_t time = 1679616000000;   // March 24th, 2023 in milliseconds
+
+    std::vector<std::string> levels = {"INFO", "DEBUG", "WARN", "ERROR"};
+    std::vector<std::string> methods = {"GET", "POST", "PUT", "DELETE"};
+    std::vector<std::string> paths = {"/api/v1/users", "/api/v1/orders",
+        "/api/v1/items", "/api/v1/search", "/health", "/api/v1/login",
+        "/static/app.js", "/api/v1/cart", "/api/v1/payments", "/metrics"};
+    std::vector<int> statuses = {200, 201, 204, 304, 400, 401, 404, 500};
+    Weighted level, method, path, status;
+
+    LogGenerator(Random& rnd) : rnd(rnd), level({70, 20, 8, 2}),
+            method({60, 25, 10, 5}), path(zipf_weights(10, 1.2)),
+            status({80, 5, 3, 5, 2, 1, 3, 1}) {};
+
+    void generate(std::string& out) {
+        time += rnd.below(50);
+        time_t seconds = time / 1000;
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+                gmtime(&seconds));
+
+        // Drawn one at a time, since the order function arguments are
+        // evaluated in is up to the compiler
+        const char* lvl = levels[level.pick(rnd)].c_str();
+        int worker = rnd.below(8);
+        const char* verb = methods[method.pick(rnd)].c_str();
+        const char* where = paths[path.pick(rnd)].c_str();
+        int item = rnd.below(10000);
+        int code = statuses[status.pick(rnd)];
+        int ms = -std::log(1 - rnd.real()) * 20;
+        unsigned long long request = rnd.rng();
+
+        char line[256];
+        snprintf(line, sizeof(line),
+                "%s.%03dZ %-5s [worker-%d] %s %s/%d %d %dms "
+                "request_id=%016llx\n",
+                stamp, (int)(time % 1000), lvl, worker, verb, where, item,
+                code, ms, request);
+        out += line;
+    }
+};
+
+// 16 byte records: an increasing id, a type from a few values, mostly zero
+// flags, and a value that is usually small
+struct BinaryGenerator : Generator {
+    Random& rnd;
+    uint32_t id = 0;
+    Weighted type;
+
+    BinaryGenerator(Random& rnd) : rnd(rnd), type(zipf_weights(6, 1.5)) {};
+
+    void put(std::string& out, uint64_t value, int bytes) {
+        for(int b=0; b<bytes; b++)
+            out.push_back(value >> (8*b) & 0xFF);
+    }
+
+    void generate(std::string& out) {
+        put(out, id++, 4);
+        put(out, type.pick(rnd), 2);
+        put(out, rnd.below(16) ? 0 : 1 << rnd.below(16), 2);
+        put(out, (uint64_t)(-std::log(1 - rnd.real()) * 100), 8);
+    }
+};
+
+#endif
@@ -14,255 +14,2630 @@
 // frequent symbols near the top of the tree, we can shorten (on average) the
 // number of bits needed to represent it.
 //
-// It is worth noting that my implementation does not encode the representation
-// of the Huffman tree we used to encode the source file. In a real-world 
-// scenario we would need to also save some representation of the tree so that
-// the decoder can actually function. Lelewer & Hirschberg (1987) suggest that
-// an optimal representation of the tree takes 2n bits.
+// The tree itself is never written out. Instead the codes are made canonical:
+// symbols are sorted by code length (then by value) and given consecutive
+// codes, so the code table can be rebuilt from the code lengths alone. The
+// compressed file starts with a small header holding those lengths, which
+// makes it self-describing and decodable by a separate process.
+//
+// Compressed file layout (integers are little endian):
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (1)
+//    8 bytes   original length in bytes
+//   32 bytes   bitmap of the symbols present in the source
+//    n bytes   code length of each present symbol, in symbol order
+//    ...       canonical Huffman coded bitstream
+//
+// In block mode the input is cut into independent blocks which are encoded
+// and decoded in parallel. Each block has its own code table, or all of them
+// share one table stored in the header:
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (2)
+//    8 bytes   original length in bytes
+//    4 bytes   block size in bytes
+//    1 byte    1 if the blocks share a code table
+//    ...       shared code table (bitmap and code lengths, as above)
+//    8 bytes   compressed size of each block
+//    ...       blocks, each an optional code table followed by its bitstream
+//
+// Format version 3 is the block format with each block's bitstream split into
+// 2, 4 or 8 streams covering consecutive parts of the block, so the decoder
+// can work on all of them at once. It adds a byte holding the number of
+// streams after the shared table flag, and each block's bitstream becomes a
+// jump table of 4 byte sizes of all streams but the last, then the streams.
+//
+// Format version 4 models each byte on the one before it (its context). The
+// contexts are clustered by their statistics into at most 32 groups, and each
+// group gets a code table of its own, so rare contexts don't each cost a
+// table header and all the decode tables stay in cache:
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (4)
+//    8 bytes   original length in bytes
+//    1 byte    number of code tables
+//  256 bytes   code table of each context (the first byte's context is 0)
+//    ...       code tables (bitmap and code lengths, as above)
+//    ...       bitstream, each byte coded with its context's table
+//
+// Format version 5 puts an LZ77 stage (see LZ77.h) in front of the Huffman
+// codes, so repeated strings are coded as copies of earlier data. The data
+// becomes a series of sequences, each a run of literals followed by a match,
+// and three code tables code the literals, a token per sequence holding the
+// length codes of its literal run and match, and the match distances. Values
+// too large for their codes continue in extra bits written as they are:
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (5)
+//    8 bytes   original length in bytes
+//    ...       literal, token and distance code tables (as above)
+//    ...       bitstream of the sequences
+//
+// Format version 6 codes the bytes with tANS (table-based asymmetric numeral
+// systems, see encode_ans()) instead of Huffman codes. Version 7 is the block
+// format of version 3 where each block picks one of the two coders:
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (6)
+//    8 bytes   original length in bytes
+//   32 bytes   bitmap of the symbols present in the source
+//    n bytes   2 byte count of each present symbol, summing to 4096
+//    ...       tANS bitstream, in chunks that each start with two 12 bit states
+//
+// Format version 8 is for many small inputs, too short to pay for a code
+// table of their own. The table is trained ahead of time on sample data and
+// kept in a separate dictionary file (see load_dictionary()), and the data
+// only names it by id. The length takes a single byte under 128 bytes, so
+// the header comes to 8 bytes for the smallest inputs:
+//    4 bytes   magic "HUFC"
+//    1 byte    format version (8)
+// 1-10 bytes   original length in bytes (see put_varint())
+//    2 bytes   dictionary id
+//    ...       canonical Huffman coded bitstream
 //
 // This file (when supplied with a source file as the first argument) will
 // encode it using this static huffman algorithm, and write it to file. The 
 // file has the name "compr_huffman.dat". Then the file will be decoded and
-// written to disk again as "orig_huffman.dat". We can diff the original source
-// file with "orig_huffman.dat" to ensure the process has not lost any data.
+// written to disk again as "orig_huffman.txt". We can diff the original source
+// file with "orig_huffman.txt" to ensure the process has not lost any data.
+// Running with "-d <file>" only decompresses an existing "compr_huffman.dat"
+// style file into "orig_huffman.txt". "-b <KiB>" turns on block mode, "-s"
+// shares one code table between blocks and "-t <n>" sets the thread count.
+// "-m" streams the files through a batch of blocks at a time instead of
+// holding them in memory, so memory use stays bounded for any input size.
+// "-i <n>" splits each block into n interleaved bitstreams. "-l <bits>" caps
+// the code length, trading a little compression for codes that always fit
+// the decoder's fast lookup table; the cost is shown with the results.
+// "-x" codes with order-1 context tables, when that comes out smaller.
+// "-z <level>" adds the LZ77 stage, searching harder for matches from level 1
+// to 9, and "-W <bits>" sets its window to 2^bits bytes (20 by default).
+// "-e ans" codes with tANS instead of Huffman codes, and "-e best" with
+// whichever is smaller, for the whole file or, in block mode, per block.
+// "-D <dictionary>" codes with a trained dictionary ("Compressor train"), and
+// is needed again to decompress.
+//
+// Built with CODEC_LIBRARY defined, main() is left out and the codec goes into
+// libcodec.a instead, behind the interface in Codec.h.
+
+#include <bits/stdc++.h>
+#include <ctime>
+#include <unistd.h>
+
+#include "BitIO.h"
+#include "Codec.h"
+#include "LZ77.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
+namespace huffman {
+
+// Nodes are referred to by their index in the tree's node pool
+typedef uint16_t NodeId;
+const NodeId NO_NODE = UINT16_MAX;
+
+// Representation of a node in the Huffman tree
+struct TreeNode {
+    uint64_t freq;
+
+    NodeId left = NO_NODE;
+    NodeId right = NO_NODE;
+
+    char c;
+};
+
+// A Huffman tree over at most 256 symbols, its nodes all kept in one array
+// so building it never touches the heap and it can be thrown away whole
+struct HuffmanTree {
+    TreeNode nodes[2*256 - 1];
+    int size = 0;
+    NodeId root = NO_NODE;
+
+    NodeId add(char c, uint64_t f, NodeId left=NO_NODE, NodeId right=NO_NODE) {
+        nodes[size] = {f, left, right, c};
+        return size++;
+    }
+};
+
+// Custom comparator for usage in PQ later.
+struct CompareTreeNode {
+    TreeNode* nodes;
+
+    bool operator()(NodeId a, NodeId b) {
+        return nodes[a].freq >= nodes[b].freq;
+    }
+};
+
+const char MAGIC[4] = {'H','U','F','C'};
+const int VERSION = 1;
+const int VERSION_BLOCKS = 2;
+const int VERSION_STREAMS = 3;
+const int VERSION_CONTEXT = 4;
+const int VERSION_LZ77 = 5;
+const int VERSION_ANS = 6;
+const int VERSION_CODERS = 7;
+const int VERSION_DICTIONARY = 8;
+
+// Longest code the decoder accepts. Reaching it needs a frequency table
+// shaped like the Fibonacci sequence, summing to well over 2^40 bytes.
+const int MAX_CODE_LEN = 56;
+
+// Scan through each character in the input data and lookup the Huffman code
+// corresponding to it in a flat table indexed by the byte value. 'bits' is
+// the total length of the encoding, used to size the output up front.
+//
+// Returns a vector of bytes representing the encoded file to be written.
+std::vector<char>* encode(Code* codes, char* data, uint64_t N, uint64_t bits) {
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    std::vector<char>* output = new std::vector<char>((bits + 7) / 8 + 8);
+
+    BitWriter writer(output);
+    for(uint64_t i=0; i<N; i++) {
+        Code& c = codes[(unsigned char)data[i]];
+        writer.put(c.bits, c.len);
+        STAT_ADD(CODE_BITS, c.len);
+    }
+    writer.flush();
+
+    return output;
+}
+
+// Number of bits resolved by a single lookup in the decode table. Codes that
+// are no longer than this are decoded with one indexed load, longer codes
+// fall back to a bit by bit canonical decode.
+const int LOOKUP_BITS = 10;
+
+// Entry in the fast decode table. 'len' is the length of the code which
+// prefixes the looked up bits, or 0 if that code is longer than LOOKUP_BITS.
+struct DecodeEntry {
+    unsigned char sym;
+    unsigned char len;
+};
+
+// Everything needed to decode a canonical code, rebuilt from the code lengths.
+// Codes of length 'l' are the consecutive values starting at firstCode[l],
+// and belong to symbols[firstIndex[l]] onwards.
+struct DecodeTable {
+    DecodeEntry fast[1 << LOOKUP_BITS];
+    uint64_t firstCode[MAX_CODE_LEN+1];
+    int firstIndex[MAX_CODE_LEN+1];
+    int count[MAX_CODE_LEN+1];
+    unsigned char symbols[256];
+};
+
+// Assign canonical codes from code lengths. Symbols are ordered by length and
+// then by value, and each gets the previous code plus one (shifted left
+// whenever the length grows).
+void gen_canonical_codes(uint64_t* codes, int* lengths) {
+    int count[MAX_CODE_LEN+1] = {0};
+    for(int s=0; s<256; s++)
+        count[lengths[s]]++;
+    count[0] = 0;
+
+    uint64_t next[MAX_CODE_LEN+1];
+    uint64_t code = 0;
+    for(int l=1; l<=MAX_CODE_LEN; l++) {
+        code = (code + count[l-1]) << 1;
+        next[l] = code;
+    }
+
+    for(int s=0; s<256; s++)
+        if(lengths[s])
+            codes[s] = next[lengths[s]]++;
+}
+
+void build_decode_table(DecodeTable* table, int* lengths) {
+    STAT_PHASE(PHASE_CODEGEN);
+    memset(table->count, 0, sizeof(table->count));
+    for(int s=0; s<256; s++)
+        table->count[lengths[s]]++;
+    table->count[0] = 0;
+
+    uint64_t code = 0;
+    int index = 0;
+    for(int l=1; l<=MAX_CODE_LEN; l++) {
+        code = (code + table->count[l-1]) << 1;
+        table->firstCode[l] = code;
+        table->firstIndex[l] = index;
+        index += table->count[l];
+    }
+
+    // Symbols in canonical order
+    int next[MAX_CODE_LEN+1];
+    memcpy(next, table->firstIndex, sizeof(next));
+    for(int s=0; s<256; s++)
+        if(lengths[s])
+            table->symbols[next[lengths[s]]++] = s;
+
+    // Every slot whose top bits hold a short code maps to that code's symbol
+    memset(table->fast, 0, sizeof(table->fast));
+    uint64_t codes[256];
+    gen_canonical_codes(codes, lengths);
+    for(int s=0; s<256; s++) {
+        int l = lengths[s];
+        if(!l || l > LOOKUP_BITS) continue;
+
+        int first = codes[s] << (LOOKUP_BITS - l);
+        for(int i=first; i<first+(1 << (LOOKUP_BITS - l)); i++)
+            table->fast[i] = {(unsigned char)s, (unsigned char)l};
+    }
+}
+
+// Reads a bitstream MSB-first. The bits are kept MSB-aligned in a 64-bit
+// buffer, so peeking at the next bits is just a shift of the buffer.
+struct BitReader {
+    unsigned char* ptr = nullptr;
+    unsigned char* end = nullptr;
+    uint64_t bits = 0;
+    int count = 0;
+
+    BitReader() {};
+    BitReader(char* buffer, uint64_t N)
+        : ptr((unsigned char*)buffer), end((unsigned char*)buffer + N) {};
+
+    // Top up the buffer to at least 56 bits, unless the data runs out. Away
+    // from the end a whole word is loaded and only the bytes that fit are
+    // consumed; the bits of the others land where the next refill puts them.
+    void refill() {
+        if(end - ptr >= 8) {
+            uint64_t word;
+            memcpy(&word, ptr, 8);
+            bits |= __builtin_bswap64(word) >> count;
+            ptr += (63 - count) >> 3;
+            count |= 56;
+            return;
+        }
+        while(count <= 56 && ptr < end) {
+            bits |= (uint64_t)*ptr++ << (56 - count);
+            count += 8;
+        }
+    }
+
+    void consume(int len) {
+        bits <<= len;
+        count -= len;
+    }
+};
+
+// Decode a single symbol into 'out'. Short codes are resolved with a single
+// lookup in the table indexed by the next LOOKUP_BITS bits. Longer codes are
+// found by comparing the next bits against the range of canonical codes of
+// each length in turn.
+//
+// Returns false if the input is truncated or corrupt.
+inline bool decode_symbol(DecodeTable* table, BitReader& in, char& out) {
+    in.refill();
+
+    DecodeEntry e = table->fast[in.bits >> (64 - LOOKUP_BITS)];
+    if(e.len) {
+        in.consume(e.len);
+        out = e.sym;
+        return in.count >= 0;
+    }
+
+    STAT_ADD(HUFFMAN_SLOW_DECODES, 1);
+    for(int l=LOOKUP_BITS+1; l<=MAX_CODE_LEN; l++) {
+        uint64_t code = in.bits >> (64 - l);
+        if(code - table->firstCode[l] < (uint64_t)table->count[l]) {
+            out = table->symbols[table->firstIndex[l]
+                                 + (code - table->firstCode[l])];
+            in.consume(l);
+            return in.count >= 0;
+        }
+    }
+
+    return false;
+}
+
+// Decode 'length' symbols split over K bitstreams (see encode_streams()).
+// The streams are independent, so decoding a symbol from each of them in
+// the same loop gives the CPU K chains of work to overlap instead of one.
+//
+// Returns false if the input is truncated or corrupt.
+template<int K>
+bool decode_streams(DecodeTable* table, char* buffer, uint64_t N,
+        char* output, uint64_t length) {
+    STAT_PHASE(PHASE_DECODE);
+    STAT_ADD(SYMBOLS_DECODED, length);
+    uint64_t segment = (length + K - 1) / K;
+    if(N < 4*(K-1)) return false;
+
+    BitReader in[K];
+    char* out[K];
+    uint64_t pos = 4*(K-1);
+    for(int s=0; s<K; s++) {
+        uint64_t size = s < K-1 ? get_int(buffer + 4*s, 4) : N - pos;
+        if(pos + size > N) return false;
+        in[s] = BitReader(buffer + pos, size);
+        out[s] = output + std::min(length, s*segment);
+        pos += size;
+    }
+
+    // Every stream but the last holds a full segment, so decode from all of
+    // them in lockstep for as long as the last one has symbols left. While
+    // every stream has a whole word left to read, the state is copied into
+    // locals the compiler can keep in registers, and codes that fit the fast
+    // table are resolved inline.
+    bool ok = true;
+    uint64_t last = length - std::min(length, (K-1)*segment);
+    DecodeEntry* fast = table->fast;
+    uint64_t i = 0;
+    while(i < last) {
+        uint64_t bits[K];
+        int count[K];
+        unsigned char* ptr[K];
+        char* dst[K];
+        uint64_t safe = last - i;
+        #pragma GCC unroll 8
+        for(int s=0; s<K; s++) {
+            bits[s] = in[s].bits;
+            count[s] = in[s].count;
+            ptr[s] = in[s].ptr;
+            dst[s] = out[s];
+
+            // A refill moves a stream on by at most 7 bytes, so this many
+            // rounds can all load a whole word without reading past the end
+            safe = std::min(safe, (uint64_t)(in[s].end - in[s].ptr) / 8);
+        }
+        if(safe == 0) {
+            for(int s=0; s<K; s++)
+                ok &= decode_symbol(table, in[s], *out[s]++);
+            i++;
+            continue;
+        }
+
+        for(uint64_t j=0; j<safe; j++) {
+            #pragma GCC unroll 8
+            for(int s=0; s<K; s++) {
+                uint64_t word;
+                memcpy(&word, ptr[s], 8);
+                bits[s] |= __builtin_bswap64(word) >> count[s];
+                ptr[s] += (63 - count[s]) >> 3;
+                count[s] |= 56;
+
+                DecodeEntry e = fast[bits[s] >> (64 - LOOKUP_BITS)];
+                int len = e.len;
+                if(__builtin_expect(len == 0, 0)) {
+                    // Long code, fall back to the general decoder
+                    in[s].bits = bits[s];
+                    in[s].count = count[s];
+                    in[s].ptr = ptr[s];
+                    ok &= decode_symbol(table, in[s], *dst[s]);
+                    bits[s] = in[s].bits;
+                    count[s] = in[s].count;
+                    ptr[s] = in[s].ptr;
+                } else {
+                    *dst[s] = e.sym;
+                    bits[s] <<= len;
+                    count[s] -= len;
+                }
+                dst[s]++;
+            }
+        }
+        i += safe;
+
+        for(int s=0; s<K; s++) {
+            in[s].bits = bits[s];
+            in[s].count = count[s];
+            in[s].ptr = ptr[s];
+            out[s] = dst[s];
+        }
+    }
+    for(int s=0; s<K; s++)
+        ok &= in[s].count >= 0;
+
+    // Then finish off the rest of each segment on its own
+    for(int s=0; s<K-1; s++) {
+        char* segEnd = output + std::min(length, (s+1)*segment);
+        while(ok && out[s] < segEnd)
+            ok = decode_symbol(table, in[s], *out[s]++);
+    }
+
+    return ok;
+}
+
+// Find the depth of every leaf (or symbol) in the tree. That depth is the
+// length of the symbol's code.
+void gen_code_lengths(int* lengths, HuffmanTree* tree, NodeId root,
+        int depth=0) {
+    if(root == NO_NODE) return;
+
+    TreeNode& node = tree->nodes[root];
+    if(node.left == NO_NODE) {
+        // A lone symbol still needs a 1 bit code
+        lengths[(unsigned char)node.c] = std::max(depth, 1);
+        return;
+    }
+
+    gen_code_lengths(lengths, tree, node.left, depth+1);
+    gen_code_lengths(lengths, tree, node.right, depth+1);
+}
+
+// Create lookup table of codes associated with each symbol. Only the code
+// lengths are taken from the tree, the codes themselves are canonical.
+void gen_huffman_codes(Code* codes, int* lengths) {
+    STAT_PHASE(PHASE_CODEGEN);
+    uint64_t canonical[256];
+    gen_canonical_codes(canonical, lengths);
+
+    for(int s=0; s<256; s++)
+        codes[s] = {lengths[s] ? canonical[s] : 0, lengths[s]};
+}
+
+// Total length in bits of the data once encoded
+uint64_t encoded_bits(uint64_t* freq, int* lengths) {
+    uint64_t bits = 0;
+    for(int s=0; s<256; s++)
+        bits += freq[s] * lengths[s];
+    return bits;
+}
+
+void build_huffman_tree(HuffmanTree* tree, uint64_t* freq) {
+    // MinHeap built on frequency
+    std::priority_queue<NodeId, std::vector<NodeId>, CompareTreeNode>
+        PQ(CompareTreeNode{tree->nodes});
+
+    // Initialize leaf node for each char
+    for(int s=0; s<256; s++)
+        if(freq[s])
+            PQ.push(tree->add(s,freq[s]));
+
+    // Tree merging step
+    while((int)PQ.size() > 1) {
+        // Grab the 2 lowest frequency nodes
+        NodeId left = PQ.top();
+        PQ.pop();
+
+        NodeId right = PQ.top();
+        PQ.pop();
+
+        // Merge them together with combined frequency
+        uint64_t f = tree->nodes[left].freq + tree->nodes[right].freq;
+        PQ.push(tree->add(0, f, left, right));
+    }
+    
+    // Remaining node is root of huffman tree (there is none for empty input)
+    tree->root = PQ.empty() ? NO_NODE : PQ.top();
+}
+
+// Number of interleaved sub-tables used by gen_freq_table()
+const int HIST_TABLES = 4;
+
+// Create frequency table for each character in the input file.
+//
+// Consecutive bytes are counted in different sub-tables, so runs of the same
+// byte don't have to wait on the increment of the previous one to land in
+// memory. The sub-tables use 32-bit counters to stay small, and are folded
+// into the 64-bit totals every HIST_CHUNK bytes, well before they can wrap.
+void gen_freq_table(uint64_t* freq, char* buffer, uint64_t N) {
+    STAT_PHASE(PHASE_FREQ);
+    const uint64_t HIST_CHUNK = 1ULL << 30;
+    uint32_t counts[HIST_TABLES][256];
+    unsigned char* data = (unsigned char*)buffer;
+
+    memset(freq, 0, 256 * sizeof(uint64_t));
+    for(uint64_t start=0; start<N; start+=HIST_CHUNK) {
+        uint64_t end = std::min(N, start + HIST_CHUNK);
+        memset(counts, 0, sizeof(counts));
+
+        // Load 8 bytes at a time and spread them over the sub-tables
+        uint64_t i = start;
+        for(; i+8<=end; i+=8) {
+            uint64_t w;
+            memcpy(&w, data + i, 8);
+            counts[0][w & 0xFF]++;
+            counts[1][w >> 8 & 0xFF]++;
+            counts[2][w >> 16 & 0xFF]++;
+            counts[3][w >> 24 & 0xFF]++;
+            counts[0][w >> 32 & 0xFF]++;
+            counts[1][w >> 40 & 0xFF]++;
+            counts[2][w >> 48 & 0xFF]++;
+            counts[3][w >> 56]++;
+        }
+        for(; i<end; i++)
+            counts[i % HIST_TABLES][data[i]]++;
+
+        // Straight-line reduction over fixed-size arrays, which the compiler
+        // turns into vector adds
+        for(int s=0; s<256; s++)
+            freq[s] += (uint64_t)counts[0][s] + counts[1][s]
+                     + counts[2][s] + counts[3][s];
+    }
+}
+
+// Write a code table as a bitmap of the symbols present followed by the
+// code length of each of them
+void write_code_lengths(std::vector<char>* output, int* lengths) {
+    unsigned char bitmap[32] = {0};
+    for(int s=0; s<256; s++)
+        if(lengths[s])
+            bitmap[s/8] |= 1 << (s%8);
+    output->insert(output->end(), bitmap, bitmap + 32);
+
+    for(int s=0; s<256; s++)
+        if(lengths[s])
+            output->push_back(lengths[s]);
+}
+
+// Parse a code table written by write_code_lengths().
+// Returns the number of bytes read, or -1 if it is not valid.
+int read_code_lengths(char* buffer, uint64_t N, int* lengths) {
+    if(N < 32) return -1;
+
+    int pos = 32;
+    for(int s=0; s<256; s++) {
+        lengths[s] = 0;
+        if(!(buffer[s/8] & (1 << (s%8)))) continue;
+        if((uint64_t)pos >= N) return -1;
+        lengths[s] = (unsigned char)buffer[pos++];
+        if(lengths[s] < 1 || lengths[s] > MAX_CODE_LEN) return -1;
+    }
+
+    return pos;
+}
+
+// Longest code the encoder may produce, set with "-l". Lowering it costs a
+// little compression but keeps every code inside the decoder's fast table.
+// Each codec has its own, which also adds up the size in bits of everything
+// coded with the optimal (unlimited) codes and with the codes actually used,
+// to report what the limit cost.
+struct LengthLimit {
+    int maxLen = MAX_CODE_LEN;
+    std::atomic<uint64_t> optimalBits{0}, limitedBits{0};
+};
+
+// Find the best code lengths no longer than maxLen with the package-merge
+// algorithm. Every symbol starts as a coin worth its frequency, once for each
+// allowed length. Working up from the longest length, the cheapest coins are
+// paired into packages which compete with the coins of the next length. The
+// 2n-2 cheapest items left at the end make up the code, and the length of a
+// symbol is the number of its coins found inside them.
+void limited_code_lengths(int* lengths, uint64_t* freq_table, int maxLen) {
+    STAT_ADD(HUFFMAN_PACKAGE_MERGES, 1);
+    struct Item { uint64_t weight; int sym, left, right; };
+    std::vector<Item> items;
+    std::vector<int> coins;
+
+    memset(lengths, 0, 256 * sizeof(int));
+    for(int s=0; s<256; s++)
+        if(freq_table[s]) {
+            items.push_back({freq_table[s], s, -1, -1});
+            coins.push_back(items.size() - 1);
+        }
+    int n = coins.size();
+    if(n == 1) lengths[items[0].sym] = 1;
+    if(n <= 1) return;
+
+    auto lighter = [&](int a, int b) {
+        return items[a].weight < items[b].weight;
+    };
+    std::stable_sort(coins.begin(), coins.end(), lighter);
+
+    std::vector<int> list = coins, merged;
+    for(int len=1; len<maxLen; len++) {
+        // Pair up the cheapest items into packages, which stay sorted
+        std::vector<int> packages;
+        for(size_t i=0; i+1<list.size(); i+=2) {
+            items.push_back({items[list[i]].weight + items[list[i+1]].weight,
+                    -1, list[i], list[i+1]});
+            packages.push_back(items.size() - 1);
+        }
+
+        // Merge them with a fresh set of coins
+        merged.clear();
+        std::merge(coins.begin(), coins.end(), packages.begin(),
+                packages.end(), std::back_inserter(merged), lighter);
+        list.swap(merged);
+    }
+
+    // Count the coins of each symbol in the chosen items
+    std::stack<int> S;
+    for(int i=0; i<2*n-2; i++) S.push(list[i]);
+    while(!S.empty()) {
+        Item& cur = items[S.top()];
+        S.pop();
+
+        if(cur.sym >= 0) {
+            lengths[cur.sym]++;
+        } else {
+            S.push(cur.left);
+            S.push(cur.right);
+        }
+    }
+}
+
+// Build a Huffman tree from the frequency table and find the code length of
+// each symbol, limited to limit.maxLen bits. Returns the length in bits of
+// the data once encoded with those codes.
+uint64_t huffman_code_lengths_from(int* lengths, uint64_t* freq_table,
+        LengthLimit& limit) {
+    STAT_PHASE(PHASE_TREE);
+    HuffmanTree tree;
+    build_huffman_tree(&tree, freq_table);
+
+    memset(lengths, 0, 256 * sizeof(int));
+    gen_code_lengths(lengths, &tree, tree.root);
+
+    // Fall back on package-merge if the tree is deeper than allowed
+    uint64_t bits = encoded_bits(freq_table, lengths);
+    limit.optimalBits += bits;
+    if(*std::max_element(lengths, lengths + 256) > limit.maxLen) {
+        limited_code_lengths(lengths, freq_table, limit.maxLen);
+        bits = encoded_bits(freq_table, lengths);
+    }
+    limit.limitedBits += bits;
+
+    return bits;
+}
+
+// Same as above, over the frequency table of the data
+uint64_t huffman_code_lengths(int* lengths, char* data, uint64_t N,
+        LengthLimit& limit) {
+    uint64_t freq_table[256];
+    gen_freq_table(freq_table, data, N);
+    return huffman_code_lengths_from(lengths, freq_table, limit);
+}
+
+// Encode data with the code table given by 'lengths'. Returns the bitstream.
+std::vector<char>* encode_with(int* lengths, char* data, uint64_t N,
+        uint64_t bits) {
+    Code codes[256];
+    gen_huffman_codes(codes, lengths);
+    return encode(codes, data, N, bits);
+}
+
+// Compress the data as a single canonical Huffman stream (format version 1)
+// with the code table given by 'lengths'
+std::vector<char>* compress_with(int* lengths, char* data, uint64_t N,
+        uint64_t bits) {
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->push_back(VERSION);
+    put_int(output, N, 8);
+    write_code_lengths(output, lengths);
+
+    std::vector<char>* encoded = encode_with(lengths, data, N, bits);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+
+    return output;
+}
+
+// Compress the data as a single canonical Huffman stream (format version 1)
+std::vector<char>* compress(char* data, uint64_t N, LengthLimit& limit) {
+    int lengths[256];
+    uint64_t bits = huffman_code_lengths(lengths, data, N, limit);
+    return compress_with(lengths, data, N, bits);
+}
+
+// Most code tables an order-1 file can have. Each decode table is a few KiB,
+// so all of them together still fit in the L2 cache.
+const int MAX_CONTEXT_TABLES = 32;
+
+// Count each byte under the byte before it (its context). The first byte is
+// counted under a context of 0.
+void gen_context_freq(uint64_t (*freq)[256], char* buffer, uint64_t N) {
+    STAT_PHASE(PHASE_FREQ);
+    unsigned char* data = (unsigned char*)buffer;
+    memset(freq, 0, 256 * sizeof(*freq));
+    if(N == 0) return;
+
+    freq[0][data[0]]++;
+    for(uint64_t i=1; i<N; i++)
+        freq[data[i-1]][data[i]]++;
+}
+
+// Size in bits of the symbols in a histogram coded at their own entropy
+double entropy_bits(uint64_t* freq) {
+    uint64_t total = 0;
+    for(int s=0; s<256; s++)
+        total += freq[s];
+
+    double bits = 0;
+    for(int s=0; s<256; s++)
+        if(freq[s])
+            bits += freq[s] * std::log2((double)total / freq[s]);
+    return bits;
+}
+
+// Size in bits of the code table of a histogram, as write_code_lengths()
+// stores it
+int table_bits(uint64_t* freq) {
+    int present = 0;
+    for(int s=0; s<256; s++)
+        present += freq[s] > 0;
+    return 8 * (32 + present);
+}
+
+// Group the contexts into at most MAX_CONTEXT_TABLES clusters of similar
+// statistics, which share a code table. Stores the cluster of each context
+// in 'map' and the histogram of each cluster in 'clusters'. Returns the
+// number of clusters.
+//
+// The busiest contexts start out in clusters of their own, and the rest
+// share the last one. Then, a few times over, every context moves to the
+// cluster whose symbol probabilities code it in the fewest bits, and the
+// clusters are recounted. Last, the smallest cluster is merged into the one
+// it costs the fewest bits to join, for as long as that costs less than the
+// code table it saves.
+int cluster_contexts(uint64_t (*freq)[256], unsigned char* map,
+        uint64_t (*clusters)[256]) {
+    const int ROUNDS = 4;
+    uint64_t count[256];
+    std::vector<int> contexts;
+    std::vector<int> symbols[256];  // The symbols seen in each context
+    for(int c=0; c<256; c++) {
+        count[c] = 0;
+        for(int s=0; s<256; s++) {
+            count[c] += freq[c][s];
+            if(freq[c][s])
+                symbols[c].push_back(s);
+        }
+        if(count[c])
+            contexts.push_back(c);
+    }
+    std::stable_sort(contexts.begin(), contexts.end(),
+            [&](int a, int b) { return count[a] > count[b]; });
+
+    memset(map, 0, 256);
+    int K = std::min<int>(MAX_CONTEXT_TABLES, contexts.size());
+    for(size_t i=0; i<contexts.size(); i++)
+        map[contexts[i]] = std::min<int>(i, K-1);
+
+    auto recount = [&]() {
+        memset(clusters, 0, K * sizeof(*clusters));
+        for(int c : contexts)
+            for(int s : symbols[c])
+                clusters[map[c]][s] += freq[c][s];
+    };
+
+    // Cost of each symbol under each cluster. Symbols a cluster hasn't seen
+    // get a small share, so contexts can still move to it.
+    std::vector<double> cost(K * 256);
+    for(int round=0; round<ROUNDS; round++) {
+        recount();
+        for(int k=0; k<K; k++) {
+            uint64_t total = 0;
+            for(int s=0; s<256; s++)
+                total += clusters[k][s];
+            for(int s=0; s<256; s++)
+                cost[k*256 + s] = std::log2((total + 128.0)
+                        / (clusters[k][s] + 0.5));
+        }
+
+        for(int c : contexts) {
+            double best = 0;
+            for(int k=0; k<K; k++) {
+                double bits = 0;
+                for(int s : symbols[c])
+                    bits += freq[c][s] * cost[k*256 + s];
+                if(k == 0 || bits < best) {
+                    best = bits;
+                    map[c] = k;
+                }
+            }
+        }
+    }
+
+    // Number the clusters still in use from 0
+    int renumber[MAX_CONTEXT_TABLES];
+    bool used[MAX_CONTEXT_TABLES] = {false};
+    for(int c : contexts)
+        used[map[c]] = true;
+    int n = 0;
+    for(int k=0; k<K; k++)
+        renumber[k] = used[k] ? n++ : -1;
+    for(int c : contexts)
+        map[c] = renumber[map[c]];
+    K = n;
+    recount();
+
+    // Size of each cluster with its table, and its number of symbols
+    std::vector<double> size(K);
+    std::vector<uint64_t> totals(K, 0);
+    for(int k=0; k<K; k++) {
+        size[k] = entropy_bits(clusters[k]) + table_bits(clusters[k]);
+        for(int s=0; s<256; s++)
+            totals[k] += clusters[k][s];
+    }
+
+    while(K > 1) {
+        int a = std::min_element(totals.begin(), totals.begin() + K)
+            - totals.begin();
+
+        int best = -1;
+        double bestCost = 0, bestSize = 0;
+        for(int b=0; b<K; b++) {
+            if(b == a) continue;
+            uint64_t merged[256];
+            for(int s=0; s<256; s++)
+                merged[s] = clusters[a][s] + clusters[b][s];
+            double mergedSize = entropy_bits(merged) + table_bits(merged);
+            double cost = mergedSize - size[a] - size[b];
+            if(best < 0 || cost < bestCost) {
+                best = b;
+                bestCost = cost;
+                bestSize = mergedSize;
+            }
+        }
+        if(bestCost >= 0) break;
+
+        // Merge a into b, and move the last cluster into a's place
+        for(int s=0; s<256; s++)
+            clusters[best][s] += clusters[a][s];
+        totals[best] += totals[a];
+        size[best] = bestSize;
+        K--;
+        memmove(clusters[a], clusters[K], sizeof(*clusters));
+        totals[a] = totals[K];
+        size[a] = size[K];
+        for(int c : contexts) {
+            if(map[c] == a)
+                map[c] = best;
+            if(map[c] == K)
+                map[c] = a;
+        }
+    }
+
+    return K;
+}
+
+// Encode the data with the code table of each byte's context
+std::vector<char>* encode_contexts(int (*lengths)[256], unsigned char* map,
+        char* data, uint64_t N, uint64_t bits) {
+    int ntables = *std::max_element(map, map + 256) + 1;
+    Code (*codes)[256] = new Code[ntables][256];
+    for(int t=0; t<ntables; t++)
+        gen_huffman_codes(codes[t], lengths[t]);
+
+    Code* byContext[256];
+    for(int c=0; c<256; c++)
+        byContext[c] = codes[map[c]];
+
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    std::vector<char>* output = new std::vector<char>((bits + 7) / 8 + 8);
+
+    BitWriter writer(output);
+    unsigned char prev = 0;
+    for(uint64_t i=0; i<N; i++) {
+        unsigned char s = data[i];
+        Code& c = byContext[prev][s];
+        writer.put(c.bits, c.len);
+        STAT_ADD(CODE_BITS, c.len);
+        prev = s;
+    }
+    writer.flush();
+
+    delete[] codes;
+    return output;
+}
+
+// Decode 'length' symbols coded with the table of each one's context.
+// Returns false if the input is truncated or corrupt.
+bool decode_contexts(DecodeTable* tables, unsigned char* map, char* buffer,
+        uint64_t N, char* output, uint64_t length) {
+    STAT_PHASE(PHASE_DECODE);
+    STAT_ADD(SYMBOLS_DECODED, length);
+    DecodeTable* byContext[256];
+    for(int c=0; c<256; c++)
+        byContext[c] = tables + map[c];
+
+    BitReader in(buffer, N);
+    unsigned char prev = 0;
+    for(uint64_t i=0; i<length; i++) {
+        char c;
+        if(!decode_symbol(byContext[prev], in, c))
+            return false;
+        output[i] = c;
+        prev = c;
+    }
+
+    return true;
+}
+
+// Compress the data with order-1 contexts (format version 4): each byte is
+// coded with the table of the cluster its previous byte belongs to. Falls
+// back on the single stream format when that comes out smaller, as it does
+// for small or context-free data.
+std::vector<char>* compress_contexts(char* data, uint64_t N,
+        LengthLimit& limit) {
+    uint64_t (*freq)[256] = new uint64_t[256][256];
+    gen_context_freq(freq, data, N);
+
+    unsigned char map[256];
+    uint64_t (*clusters)[256] = new uint64_t[MAX_CONTEXT_TABLES][256];
+    int ntables = cluster_contexts(freq, map, clusters);
+    delete[] freq;
+
+    int (*lengths)[256] = new int[MAX_CONTEXT_TABLES][256];
+    uint64_t bits = 0;
+    uint64_t headerBits = 8 * (1 + 256);
+    uint64_t flat[256] = {0};
+    for(int t=0; t<ntables; t++) {
+        bits += huffman_code_lengths_from(lengths[t], clusters[t], limit);
+        headerBits += table_bits(clusters[t]);
+        for(int s=0; s<256; s++)
+            flat[s] += clusters[t][s];
+    }
+    delete[] clusters;
+
+    int flatLengths[256];
+    uint64_t flatBits = huffman_code_lengths_from(flatLengths, flat, limit);
+    if(ntables == 0 || flatBits + table_bits(flat) <= bits + headerBits) {
+        delete[] lengths;
+        return compress_with(flatLengths, data, N, flatBits);
+    }
+
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->push_back(VERSION_CONTEXT);
+    put_int(output, N, 8);
+    output->push_back(ntables);
+    output->insert(output->end(), map, map + 256);
+    for(int t=0; t<ntables; t++)
+        write_code_lengths(output, lengths[t]);
+
+    std::vector<char>* encoded = encode_contexts(lengths, map, data, N, bits);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+    delete[] lengths;
+
+    return output;
+}
+
+// Code tables of the LZ77 format
+enum LzTable { LZ_LITERALS, LZ_TOKENS, LZ_DISTANCES, LZ_TABLES };
+
+// Literal run lengths and match lengths (less MIN_MATCH - 1) are coded in 4
+// bits: 0 to 7 stand for themselves, and code c above that for a value of
+// c - 5 bits, whose bits below the top one follow as they are
+inline int length_code(uint32_t v) {
+    return v < 8 ? v : 36 - __builtin_clz(v);
+}
+
+// Distances less 1 are coded like the lengths in deflate: 0 to 3 stand for
+// themselves, and above that each power of 2 is split over two codes by the
+// bit below the top one, and the rest of the bits follow as they are
+inline int distance_code(uint32_t v) {
+    if(v < 4) return v;
+    int n = 31 - __builtin_clz(v);
+    return 2*n + (v >> (n-1) & 1);
+}
+
+// Sequence token: the code of the literal run length and of the match length
+inline int token_code(const Sequence& seq) {
+    uint32_t match = seq.matchLen ? seq.matchLen - MIN_MATCH + 1 : 0;
+    return length_code(seq.literals) << 4 | length_code(match);
+}
+
+// Encode the sequences found by the LZ77 stage with the three code tables.
+// Each sequence is its token, the extra bits of its literal run length, its
+// literals, then the extra bits of its match length, its distance code and
+// the extra bits of its distance.
+std::vector<char>* encode_lz77(int (*lengths)[256], std::vector<Sequence>& seqs,
+        char* data, uint64_t N, uint64_t bits) {
+    Code codes[LZ_TABLES][256];
+    for(int t=0; t<LZ_TABLES; t++)
+        gen_huffman_codes(codes[t], lengths[t]);
+
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    std::vector<char>* output = new std::vector<char>((bits + 7) / 8 + 8);
+
+    BitWriter writer(output);
+    unsigned char* in = (unsigned char*)data;
+    for(const Sequence& seq : seqs) {
+        Code& token = codes[LZ_TOKENS][token_code(seq)];
+        writer.put(token.bits, token.len);
+        if(seq.literals >= 8) {
+            int n = 31 - __builtin_clz(seq.literals);
+            writer.put(seq.literals & ((1u << n) - 1), n);
+        }
+        for(uint32_t i=0; i<seq.literals; i++) {
+            Code& c = codes[LZ_LITERALS][*in++];
+            writer.put(c.bits, c.len);
+            STAT_ADD(CODE_BITS, c.len);
+        }
+        if(!seq.matchLen) continue;
+
+        uint32_t match = seq.matchLen - MIN_MATCH + 1;
+        if(match >= 8) {
+            int n = 31 - __builtin_clz(match);
+            writer.put(match & ((1u << n) - 1), n);
+        }
+        uint32_t v = seq.dist - 1;
+        Code& d = codes[LZ_DISTANCES][distance_code(v)];
+        writer.put(d.bits, d.len);
+        if(v >= 4) {
+            int n = 31 - __builtin_clz(v) - 1;
+            writer.put(v & ((1u << n) - 1), n);
+        }
+        in += seq.matchLen;
+    }
+    writer.flush();
+
+    return output;
+}
+
+// Read 'n' bits as they are. Returns false if the input runs out.
+inline bool read_bits(BitReader& in, int n, uint32_t& value) {
+    in.refill();
+    value = in.bits >> (64 - n);
+    in.consume(n);
+    return in.count >= 0;
+}
+
+// Read the value of a length code
+inline bool read_length(BitReader& in, int code, uint32_t& value) {
+    if(code < 8) {
+        value = code;
+        return true;
+    }
+    int n = code - 5;
+    if(!read_bits(in, n, value)) return false;
+    value |= 1u << n;
+    return true;
+}
+
+// Decode the sequences written by encode_lz77() into 'length' bytes.
+// Returns false if the input is truncated or corrupt.
+bool decode_lz77(DecodeTable* tables, char* buffer, uint64_t N, char* output,
+        uint64_t length) {
+    STAT_PHASE(PHASE_DECODE);
+    STAT_ADD(SYMBOLS_DECODED, length);
+    BitReader in(buffer, N);
+    uint64_t pos = 0;
+    while(pos < length) {
+        char c;
+        if(!decode_symbol(tables + LZ_TOKENS, in, c)) return false;
+        int token = (unsigned char)c;
+
+        uint32_t literals, match;
+        if(!read_length(in, token >> 4, literals)) return false;
+        if(literals > length - pos) return false;
+        for(uint32_t i=0; i<literals; i++)
+            if(!decode_symbol(tables + LZ_LITERALS, in, output[pos++]))
+                return false;
+
+        if(!(token & 15)) {
+            // Only a sequence without a match can be all literals
+            if(!literals) return false;
+            continue;
+        }
+        if(!read_length(in, token & 15, match)) return false;
+        uint64_t matchLen = match + MIN_MATCH - 1;
+
+        if(!decode_symbol(tables + LZ_DISTANCES, in, c)) return false;
+        int code = (unsigned char)c;
+        uint32_t v = code;
+        if(code >= 4) {
+            int n = code/2 - 1;
+            if(n > 30 || !read_bits(in, n, v)) return false;
+            v |= (2u | (code & 1)) << n;
+        }
+        uint64_t dist = (uint64_t)v + 1;
+        if(dist > pos || matchLen > length - pos) return false;
+
+        // The copy overlaps its own output when the match is closer than its
+        // length, so then it goes a byte at a time
+        char* dst = output + pos;
+        char* src = dst - dist;
+        if(dist >= matchLen)
+            memcpy(dst, src, matchLen);
+        else
+            for(uint64_t i=0; i<matchLen; i++)
+                dst[i] = src[i];
+        pos += matchLen;
+    }
+
+    return true;
+}
+
+// Compress the data with the LZ77 front end (format version 5) at the given
+// level, with a window of 2^windowBits bytes. Falls back on the single stream
+// format when that comes out smaller, as it does when nothing repeats.
+std::vector<char>* compress_lz77(char* data, uint64_t N, int level,
+        int windowBits, LengthLimit& limit) {
+    std::vector<Sequence>* seqs = lz77_parse(data, N, level, windowBits);
+
+    uint64_t freq[LZ_TABLES][256];
+    uint64_t flat[256];
+    memset(freq, 0, sizeof(freq));
+    gen_freq_table(flat, data, N);
+    uint64_t extraBits = 0;
+    {
+        STAT_PHASE(PHASE_FREQ);
+        unsigned char* in = (unsigned char*)data;
+        for(const Sequence& seq : *seqs) {
+            freq[LZ_TOKENS][token_code(seq)]++;
+            if(seq.literals >= 8)
+                extraBits += 31 - __builtin_clz(seq.literals);
+            for(uint32_t i=0; i<seq.literals; i++)
+                freq[LZ_LITERALS][in[i]]++;
+            in += seq.literals + seq.matchLen;
+            if(!seq.matchLen) continue;
+
+            uint32_t match = seq.matchLen - MIN_MATCH + 1;
+            if(match >= 8)
+                extraBits += 31 - __builtin_clz(match);
+            uint32_t v = seq.dist - 1;
+            freq[LZ_DISTANCES][distance_code(v)]++;
+            if(v >= 4)
+                extraBits += 30 - __builtin_clz(v);
+        }
+    }
+
+    int lengths[LZ_TABLES][256];
+    uint64_t bits = extraBits;
+    uint64_t headerBits = 0;
+    for(int t=0; t<LZ_TABLES; t++) {
+        bits += huffman_code_lengths_from(lengths[t], freq[t], limit);
+        headerBits += table_bits(freq[t]);
+    }
+
+    int flatLengths[256];
+    uint64_t flatBits = huffman_code_lengths_from(flatLengths, flat, limit);
+    if(flatBits + table_bits(flat) <= bits + headerBits) {
+        delete seqs;
+        return compress_with(flatLengths, data, N, flatBits);
+    }
+
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->push_back(VERSION_LZ77);
+    put_int(output, N, 8);
+    for(int t=0; t<LZ_TABLES; t++)
+        write_code_lengths(output, lengths[t]);
+
+    std::vector<char>* encoded = encode_lz77(lengths, *seqs, data, N, bits);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+    delete seqs;
+
+    return output;
+}
+
+// Decode 'length' symbols from a single bitstream into 'output'.
+// Returns false if the input is truncated or corrupt.
+bool decode(DecodeTable* table, char* buffer, uint64_t N,
+        char* output, uint64_t length) {
+    return decode_streams<1>(table, buffer, N, output, length);
+}
+
+// Encode the data split into K consecutive segments, each its own bitstream,
+// so they can be decoded side by side (see decode_streams()). The streams
+// are preceded by a jump table of the sizes of all but the last.
+std::vector<char>* encode_streams(int* lengths, char* data, uint64_t N,
+        int K, uint64_t bits) {
+    uint64_t segment = (N + K - 1) / K;
+
+    std::vector<char>* output = new std::vector<char>(4*(K-1));
+    for(int s=0; s<K; s++) {
+        uint64_t start = std::min(N, s*segment);
+        uint64_t size = std::min(N, start + segment) - start;
+        std::vector<char>* encoded = encode_with(lengths, data + start, size,
+                bits / K);
+        if(s < K-1)
+            for(int b=0; b<4; b++)
+                (*output)[4*s + b] = encoded->size() >> (8*b) & 0xFF;
+        output->insert(output->end(), encoded->begin(), encoded->end());
+        delete encoded;
+    }
+
+    return output;
+}
+
+// Decode the K bitstreams written by encode_streams()
+bool decode_streams(DecodeTable* table, char* buffer, uint64_t N,
+        char* output, uint64_t length, int K) {
+    switch(K) {
+        case 1: return decode_streams<1>(table, buffer, N, output, length);
+        case 2: return decode_streams<2>(table, buffer, N, output, length);
+        case 4: return decode_streams<4>(table, buffer, N, output, length);
+        case 8: return decode_streams<8>(table, buffer, N, output, length);
+    }
+    return false;
+}
+
+// Table-based asymmetric numeral systems (tANS) coder, the alternative to the
+// Huffman codes. The byte frequencies are scaled to counts that sum to the
+// table size, and each symbol owns as many of the table's states as its
+// count. Coding a symbol moves the coder from one state to another and emits
+// just enough low bits of the old state for the decoder to get it back, which
+// averages out to fractions of a bit per symbol where Huffman codes would
+// round up to whole bits.
+//
+// The decoder runs the encoder backwards, so symbols are encoded from last
+// to first. Each chunk of ANS_CHUNK symbols is encoded on its own, with the
+// bits buffered and then written in the order the decoder reads them,
+// preceded by the states the decoder starts in. There are two states, taking
+// turns symbol by symbol, so the decoder has two independent chains of table
+// lookups to overlap.
+const int ANS_TABLE_LOG = 12;
+const int ANS_TABLE_SIZE = 1 << ANS_TABLE_LOG;
+const int ANS_CHUNK = 1 << 16;
+
+struct AnsDecodeEntry {
+    uint16_t base;      // next state, before adding the bits read
+    unsigned char sym;
+    unsigned char bits;
+};
+
+struct AnsTables {
+    uint32_t counts[256];
+    AnsDecodeEntry decode[ANS_TABLE_SIZE];
+
+    // Encoder: the states of each symbol, in order, starting at start[s]
+    uint16_t states[ANS_TABLE_SIZE];
+    uint32_t start[256];
+    int maxBits[256];
+};
+
+// Size in bits of the data coded with the scaled counts, leaving out the
+// start states of each chunk
+double ans_bits(uint64_t* freq, uint32_t* counts) {
+    double bits = 0;
+    for(int s=0; s<256; s++)
+        if(freq[s])
+            bits += freq[s] * (ANS_TABLE_LOG - std::log2(counts[s]));
+    return bits;
+}
+
+// Scale a frequency table to counts summing to ANS_TABLE_SIZE, keeping every
+// present symbol at 1 or more. After rounding, the counts are nudged one at a
+// time where that costs the fewest bits until they add up.
+void normalize_freq(uint32_t* counts, uint64_t* freq) {
+    uint64_t total = 0;
+    for(int s=0; s<256; s++)
+        total += freq[s];
+
+    memset(counts, 0, 256 * sizeof(uint32_t));
+    if(total == 0) return;
+    int64_t sum = 0;
+    for(int s=0; s<256; s++) {
+        if(!freq[s]) continue;
+        counts[s] = std::max<uint32_t>(1,
+                std::llround((double)freq[s] * ANS_TABLE_SIZE / total));
+        sum += counts[s];
+    }
+
+    while(sum != ANS_TABLE_SIZE) {
+        int step = sum < ANS_TABLE_SIZE ? 1 : -1;
+        int best = -1;
+        double bestCost = 0;
+        for(int s=0; s<256; s++) {
+            if(!freq[s] || counts[s] + step < 1) continue;
+            double cost = freq[s] * std::log2((double)counts[s]
+                    / (counts[s] + step));
+            if(best < 0 || cost < bestCost) {
+                best = s;
+                bestCost = cost;
+            }
+        }
+        counts[best] += step;
+        sum += step;
+    }
+}
+
+// Build the coding tables from counts summing to ANS_TABLE_SIZE. The states
+// of each symbol are spread over the table with a fixed stride, so every
+// symbol's states are mixed in among the others'.
+void build_ans_tables(AnsTables* t, uint32_t* counts) {
+    STAT_PHASE(PHASE_CODEGEN);
+    const int MASK = ANS_TABLE_SIZE - 1;
+    const int STEP = (ANS_TABLE_SIZE >> 1) + (ANS_TABLE_SIZE >> 3) + 3;
+    unsigned char spread[ANS_TABLE_SIZE];
+    uint32_t next[256];
+
+    memcpy(t->counts, counts, 256 * sizeof(uint32_t));
+    int pos = 0;
+    uint32_t start = 0;
+    for(int s=0; s<256; s++) {
+        t->start[s] = start;
+        start += counts[s];
+        next[s] = counts[s];
+        t->maxBits[s] = counts[s]
+            ? ANS_TABLE_LOG - (31 - __builtin_clz(counts[s])) : 0;
+        for(uint32_t i=0; i<counts[s]; i++) {
+            spread[pos] = s;
+            pos = (pos + STEP) & MASK;
+        }
+    }
+
+    // State u is the x'th state of its symbol, and decoding it leaves x
+    // shifted up by enough bits to be a whole state again
+    for(int u=0; u<ANS_TABLE_SIZE; u++) {
+        int s = spread[u];
+        uint32_t x = next[s]++;
+        int bits = ANS_TABLE_LOG - (31 - __builtin_clz(x));
+        t->decode[u] = {(uint16_t)((x << bits) - ANS_TABLE_SIZE),
+                        (unsigned char)s, (unsigned char)bits};
+        t->states[t->start[s] + x - counts[s]] = u + ANS_TABLE_SIZE;
+    }
+}
+
+// Write the scaled counts as a bitmap of the symbols present followed by the
+// 2 byte count of each of them
+void write_ans_counts(std::vector<char>* output, uint32_t* counts) {
+    unsigned char bitmap[32] = {0};
+    for(int s=0; s<256; s++)
+        if(counts[s])
+            bitmap[s/8] |= 1 << (s%8);
+    output->insert(output->end(), bitmap, bitmap + 32);
+
+    for(int s=0; s<256; s++)
+        if(counts[s])
+            put_int(output, counts[s], 2);
+}
+
+// Parse the counts written by write_ans_counts().
+// Returns the number of bytes read, or -1 if they are not valid.
+int read_ans_counts(char* buffer, uint64_t N, uint32_t* counts) {
+    if(N < 32) return -1;
+
+    int pos = 32;
+    uint32_t sum = 0;
+    for(int s=0; s<256; s++) {
+        counts[s] = 0;
+        if(!(buffer[s/8] & (1 << (s%8)))) continue;
+        if((uint64_t)pos + 2 > N) return -1;
+        counts[s] = get_int(buffer + pos, 2);
+        pos += 2;
+        if(counts[s] < 1) return -1;
+        sum += counts[s];
+    }
+
+    // No symbols at all for empty data
+    return sum == ANS_TABLE_SIZE || sum == 0 ? pos : -1;
+}
 
-#include <bits/stdc++.h>
-#include <ctime>
+// Encode the data with the tANS tables. 'bits' is an estimate of the encoded
+// size, used to size the output up front.
+std::vector<char>* encode_ans(AnsTables* t, char* buffer, uint64_t N,
+        uint64_t bits) {
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    unsigned char* data = (unsigned char*)buffer;
+    std::vector<char>* output = new std::vector<char>((bits + 7) / 8 + 8);
+    std::vector<uint32_t> emitted(std::min<uint64_t>(N, ANS_CHUNK));
 
-// Representation of a node in the Huffman tree
-struct TreeNode {
-    char c;
-    int freq;
+    BitWriter writer(output);
+    for(uint64_t start=0; start<N; start+=ANS_CHUNK) {
+        int n = std::min<uint64_t>(ANS_CHUNK, N - start);
 
-    TreeNode* left = nullptr;
-    TreeNode* right = nullptr;
+        // Low bits of the state, with their count in the bottom 5 bits
+        uint32_t state[2] = {ANS_TABLE_SIZE, ANS_TABLE_SIZE};
+        for(int i=n-1; i>=0; i--) {
+            uint32_t& x = state[i & 1];
+            int s = data[start + i];
+            int k = t->maxBits[s];
+            int nbits = k - (x < t->counts[s] << k);
+            emitted[i] = (x & ((1u << nbits) - 1)) << 5 | nbits;
+            x = t->states[t->start[s] + (x >> nbits) - t->counts[s]];
+        }
 
-    TreeNode(char c, int f) : c(c), freq(f) {};
-};
+        writer.put(state[0] - ANS_TABLE_SIZE, ANS_TABLE_LOG);
+        writer.put(state[1] - ANS_TABLE_SIZE, ANS_TABLE_LOG);
+        for(int i=0; i<n; i++) {
+            writer.put(emitted[i] >> 5, emitted[i] & 31);
+            STAT_ADD(CODE_BITS, emitted[i] & 31);
+        }
+    }
+    writer.flush();
 
-// Custom comparator for usage in PQ later.
-// Special emphasis is placed on the EOF character to ensure it has the lowest
-// frequency among all characters.
-struct CompareTreeNode {
-    bool operator()(TreeNode* a, TreeNode* b) {
-        if(b->c == 3) return true;
-        if(a->c == 3) return false;
-        return a->freq >= b->freq;
+    return output;
+}
+
+// Decode 'length' symbols written by encode_ans() into 'output'. Four
+// symbols take at most 48 bits, so one refill covers four of them, and each
+// symbol is just a table lookup and a shift.
+//
+// Returns false if the input is truncated or corrupt.
+bool decode_ans(AnsTables* t, char* buffer, uint64_t N, char* output,
+        uint64_t length) {
+    STAT_PHASE(PHASE_DECODE);
+    STAT_ADD(SYMBOLS_DECODED, length);
+    AnsDecodeEntry* decode = t->decode;
+    BitReader in(buffer, N);
+
+    for(uint64_t start=0; start<length; start+=ANS_CHUNK) {
+        uint64_t n = std::min<uint64_t>(ANS_CHUNK, length - start);
+        char* out = output + start;
+
+        uint32_t state[2];
+        in.refill();
+        for(int j=0; j<2; j++) {
+            state[j] = in.bits >> (64 - ANS_TABLE_LOG);
+            in.consume(ANS_TABLE_LOG);
+        }
+
+        uint64_t i = 0;
+        for(; i+4<=n; i+=4) {
+            in.refill();
+            #pragma GCC unroll 4
+            for(int j=0; j<4; j++) {
+                uint32_t& x = state[j & 1];
+                AnsDecodeEntry e = decode[x];
+                out[i+j] = e.sym;
+                // Shifting in two steps reads nothing when e.bits is 0
+                x = e.base + ((in.bits >> 1) >> (63 - e.bits));
+                in.consume(e.bits);
+            }
+            if(in.count < 0) return false;
+        }
+        for(; i<n; i++) {
+            in.refill();
+            uint32_t& x = state[i & 1];
+            AnsDecodeEntry e = decode[x];
+            out[i] = e.sym;
+            x = e.base + ((in.bits >> 1) >> (63 - e.bits));
+            in.consume(e.bits);
+            if(in.count < 0) return false;
+        }
     }
+
+    return true;
+}
+
+// Scale the frequency table and encode the data with tANS. Returns the
+// counts followed by the bitstream.
+std::vector<char>* ans_encode_with(uint32_t* counts, uint64_t* freq,
+        char* data, uint64_t N) {
+    AnsTables* tables = new AnsTables;
+    build_ans_tables(tables, counts);
+
+    uint64_t bits = ans_bits(freq, counts)
+        + 2 * ANS_TABLE_LOG * ((N + ANS_CHUNK - 1) / ANS_CHUNK);
+    std::vector<char>* output = new std::vector<char>;
+    write_ans_counts(output, counts);
+    std::vector<char>* encoded = encode_ans(tables, data, N, bits);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+    delete tables;
+
+    return output;
+}
+
+// Parse the counts and decode a tANS bitstream, as written by
+// ans_encode_with(). Returns false if the data is not valid.
+bool ans_decode(char* buffer, uint64_t N, char* output, uint64_t length) {
+    uint32_t counts[256];
+    int read = read_ans_counts(buffer, N, counts);
+    if(read < 0) return false;
+    if(length == 0) return true;
+    if(std::accumulate(counts, counts + 256, 0u) == 0) return false;
+
+    AnsTables* tables = new AnsTables;
+    build_ans_tables(tables, counts);
+    bool ok = decode_ans(tables, buffer + read, N - read, output, length);
+    delete tables;
+
+    return ok;
+}
+
+// Whether tANS codes the data in fewer bits than the Huffman code, counting
+// the tables of both
+bool ans_is_smaller(uint64_t* freq, uint32_t* counts, int* lengths,
+        uint64_t N) {
+    int present = 0;
+    for(int s=0; s<256; s++)
+        present += freq[s] > 0;
+    double ansBits = ans_bits(freq, counts) + 8 * (32 + 2*present)
+        + 2 * ANS_TABLE_LOG * ((N + ANS_CHUNK - 1) / ANS_CHUNK);
+    double huffmanBits = encoded_bits(freq, lengths) + 8 * (32 + present);
+    return ansBits < huffmanBits;
+}
+
+// Compress the data as a single stream with the given entropy coder: format
+// version 1 for Huffman codes, version 6 for tANS, or whichever of the two
+// comes out smaller
+std::vector<char>* compress_coder(char* data, uint64_t N, EntropyCoder coder,
+        LengthLimit& limit) {
+    uint64_t freq[256];
+    gen_freq_table(freq, data, N);
+    int lengths[256];
+    uint64_t bits = huffman_code_lengths_from(lengths, freq, limit);
+    uint32_t counts[256];
+    if(coder != CODER_HUFFMAN)
+        normalize_freq(counts, freq);
+
+    if(coder == CODER_HUFFMAN || (coder == CODER_BEST
+                && !ans_is_smaller(freq, counts, lengths, N)))
+        return compress_with(lengths, data, N, bits);
+
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->push_back(VERSION_ANS);
+    put_int(output, N, 8);
+    std::vector<char>* encoded = ans_encode_with(counts, freq, data, N);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+
+    return output;
+}
+
+// Settings stored in the header of the block format
+struct BlockHeader {
+    uint64_t length = 0;
+    uint64_t blockSize = 0;
+    int streams = 1;
+    bool shared = false;
+    EntropyCoder coder = CODER_HUFFMAN;
+    int lengths[256];
 };
 
-const char END_TEXT = -1;
+// Format version of the block format with these settings
+int block_version(BlockHeader& header) {
+    if(header.coder != CODER_HUFFMAN)
+        return VERSION_CODERS;
+    return header.streams > 1 ? VERSION_STREAMS : VERSION_BLOCKS;
+}
 
-// Scan through each character in the input data and lookup the Huffman code
-// corresponding to it. We need to use a byte as a buffer to write the
-// individual bytes to disk.
+// Whether a format version is one of the block formats, which can be
+// decompressed as a stream
+bool is_block_version(int version) {
+    return version == VERSION_BLOCKS || version == VERSION_STREAMS
+        || version == VERSION_CODERS;
+}
+
+// Everything before the block index in the block format
+void write_block_header(std::vector<char>* output, BlockHeader& header) {
+    int version = block_version(header);
+    output->insert(output->end(), MAGIC, MAGIC + 4);
+    output->push_back(version);
+    put_int(output, header.length, 8);
+    put_int(output, header.blockSize, 4);
+    output->push_back(header.shared);
+    if(version != VERSION_BLOCKS)
+        output->push_back(header.streams);
+    if(header.shared)
+        write_code_lengths(output, header.lengths);
+}
+
+// Parse the header written by write_block_header().
+// Returns the size of the header, or -1 if it is not valid.
+int read_block_header(char* buffer, uint64_t N, BlockHeader& header) {
+    const uint64_t FIXED = 4 + 1 + 8 + 4 + 1;
+    if(N < FIXED || memcmp(buffer, MAGIC, 4)
+            || (buffer[4] != VERSION_BLOCKS && buffer[4] != VERSION_STREAMS
+                && buffer[4] != VERSION_CODERS))
+        return -1;
+
+    header.length = get_int(buffer + 5, 8);
+    header.blockSize = get_int(buffer + 13, 4);
+    header.shared = buffer[17];
+    header.streams = 1;
+    // Which coder each block uses is up to the block
+    header.coder = buffer[4] == VERSION_CODERS ? CODER_BEST : CODER_HUFFMAN;
+    uint64_t pos = FIXED;
+    if(buffer[4] != VERSION_BLOCKS) {
+        if(N < FIXED + 1) return -1;
+        header.streams = buffer[pos++];
+    }
+    if(header.blockSize == 0 || (header.streams != 1 && header.streams != 2
+            && header.streams != 4 && header.streams != 8)
+            || (header.shared && header.coder != CODER_HUFFMAN))
+        return -1;
+
+    if(header.shared) {
+        int read = read_code_lengths(buffer + pos, N - pos, header.lengths);
+        if(read < 0) return -1;
+        pos += read;
+    }
+
+    return pos;
+}
+
+// Encode one block of the block format. Unless the header holds a shared
+// code table, the block starts with its own code table. 'bits' is an
+// estimate of the encoded size when sharing a table, the writer grows the
+// output if it is too small.
 //
-// Returns a vector of bytes representing the encoded file to be written.
-std::vector<char>* encode(std::map<char,std::string>* codes,
-        char* data, int N) {
+// In format version 7 each block starts with a byte saying which coder it
+// uses: 0 for Huffman codes, laid out as above, or 1 for tANS, followed by
+// its counts and a single bitstream. Blocks take tANS when the header asks
+// for it, or with CODER_BEST when it comes out smaller.
+std::vector<char>* encode_block(char* block, uint64_t size,
+        BlockHeader& header, uint64_t bits, LengthLimit& limit) {
+    STAT_ADD(HUFFMAN_BLOCKS, 1);
+    if(header.shared)
+        return encode_streams(header.lengths, block, size, header.streams,
+                bits);
+
+    uint64_t freq[256];
+    gen_freq_table(freq, block, size);
+    int lengths[256];
+    bits = huffman_code_lengths_from(lengths, freq, limit);
+
+    std::vector<char>* output = new std::vector<char>;
+    if(header.coder != CODER_HUFFMAN) {
+        uint32_t counts[256];
+        normalize_freq(counts, freq);
+        bool ans = header.coder == CODER_ANS
+            || ans_is_smaller(freq, counts, lengths, size);
+        output->push_back(ans);
+        if(ans) {
+            std::vector<char>* encoded = ans_encode_with(counts, freq, block,
+                    size);
+            output->insert(output->end(), encoded->begin(), encoded->end());
+            delete encoded;
+            return output;
+        }
+    }
+
+    write_code_lengths(output, lengths);
+    std::vector<char>* encoded = encode_streams(lengths, block, size,
+            header.streams, bits);
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+
+    return output;
+}
+
+// Decode one block of the block format into 'output'.
+// Returns false if the block is not valid.
+bool decode_block(char* block, uint64_t size, BlockHeader& header,
+        char* output, uint64_t expected) {
+    if(header.coder != CODER_HUFFMAN) {
+        if(size < 1 || (unsigned char)block[0] > 1) return false;
+        bool ans = block[0];
+        block++;
+        size--;
+        if(ans)
+            return ans_decode(block, size, output, expected);
+    }
+
+    int blockLengths[256];
+    int* lengths = header.lengths;
+    if(!header.shared) {
+        int read = read_code_lengths(block, size, blockLengths);
+        if(read < 0) return false;
+        block += read;
+        size -= read;
+        lengths = blockLengths;
+    }
+
+    DecodeTable* table = new DecodeTable;
+    build_decode_table(table, lengths);
+    bool ok = decode_streams(table, block, size, output, expected,
+            header.streams);
+    delete table;
+
+    return ok;
+}
+
+// Compress the data as independent blocks of 'format.blockSize' bytes
+// (format version 2, or 3 with more than one stream per block). Blocks are
+// encoded in parallel, each with its own code table unless 'format.shared'
+// is set, in which case one table built over the whole input is stored once
+// in the header.
+std::vector<char>* compress_blocks(char* data, uint64_t N,
+        BlockHeader& format, LengthLimit& limit, ThreadPool& pool) {
+    uint64_t blockSize = format.blockSize;
+    uint64_t nblocks = (N + blockSize - 1) / blockSize;
+
+    format.length = N;
+    uint64_t sharedBits = 0;
+    if(format.shared)
+        sharedBits = huffman_code_lengths(format.lengths, data, N, limit);
+
+    std::vector<std::vector<char>*> blocks(nblocks);
+    pool.parallel_for(nblocks, [&](int b) {
+        uint64_t size = std::min(blockSize, N - b*blockSize);
+        blocks[b] = encode_block(data + b*blockSize, size, format,
+                (double)sharedBits / N * size, limit);
+    });
+
     std::vector<char>* output = new std::vector<char>;
+    write_block_header(output, format);
+
+    // Block index, followed by the blocks themselves
+    for(std::vector<char>* block : blocks)
+        put_int(output, block->size(), 8);
+    for(std::vector<char>* block : blocks) {
+        output->insert(output->end(), block->begin(), block->end());
+        delete block;
+    }
+
+    return output;
+}
+
+const char DICT_MAGIC[4] = {'H','U','F','D'};
+const int DICT_VERSION = 1;
+const int DICT_ID_BYTES = 2;
+
+// A code table trained ahead of time on sample data, for compressing many
+// small inputs that are too short to pay for a table of their own. It is
+// loaded once, with its codes and decode table ready for every input.
+struct Dictionary {
+    uint16_t id;
+    int lengths[256];
+    Code codes[256];
+    DecodeTable table;
+};
+
+// FNV-1a hash of the code lengths, folded to 16 bits, stored with the data to
+// catch it being decompressed against a different dictionary
+uint16_t dictionary_id(int* lengths) {
+    uint32_t h = 2166136261u;
+    for(int s=0; s<256; s++)
+        h = (h ^ lengths[s]) * 16777619u;
+    return h ^ h >> 16;
+}
+
+Dictionary* make_dictionary(int* lengths) {
+    Dictionary* dict = new Dictionary;
+    memcpy(dict->lengths, lengths, sizeof(dict->lengths));
+    dict->id = dictionary_id(lengths);
+    gen_huffman_codes(dict->codes, lengths);
+    build_decode_table(&dict->table, lengths);
+    return dict;
+}
+
+// Build a dictionary from the byte frequencies of all the samples. Every
+// byte counts as seen at least once, so inputs can hold bytes the samples
+// don't.
+Dictionary* train_dictionary(const std::vector<MappedFile*>& samples,
+        LengthLimit& limit) {
+    uint64_t freq[256], total[256];
+    std::fill(total, total + 256, 1);
+    for(MappedFile* sample : samples) {
+        gen_freq_table(freq, sample->data, sample->size);
+        for(int s=0; s<256; s++)
+            total[s] += freq[s];
+    }
+
+    int lengths[256];
+    huffman_code_lengths_from(lengths, total, limit);
+    return make_dictionary(lengths);
+}
+
+// Dictionary file layout:
+//    4 bytes   magic "HUFD"
+//    1 byte    format version (1)
+//    2 bytes   dictionary id
+//    ...       code table (bitmap and code lengths)
+bool save_dictionary(Dictionary* dict, const char* filename) {
+    std::vector<char> output(DICT_MAGIC, DICT_MAGIC + 4);
+    output.push_back(DICT_VERSION);
+    put_int(&output, dict->id, DICT_ID_BYTES);
+    write_code_lengths(&output, dict->lengths);
+    return write_mapped(filename, output.data(), output.size());
+}
+
+// Returns nullptr if the file can't be read or is not a dictionary
+Dictionary* load_dictionary(const char* filename) {
+    MappedFile file;
+    if(!file.open_read(filename))
+        return nullptr;
+
+    const uint64_t FIXED = 4 + 1 + DICT_ID_BYTES;
+    int lengths[256];
+    if(file.size < FIXED || memcmp(file.data, DICT_MAGIC, 4)
+            || file.data[4] != DICT_VERSION
+            || read_code_lengths(file.data + FIXED, file.size - FIXED,
+                lengths) < 0
+            || dictionary_id(lengths)
+                != get_int(file.data + 5, DICT_ID_BYTES))
+        return nullptr;
+    // Every byte needs a code
+    for(int s=0; s<256; s++)
+        if(!lengths[s]) return nullptr;
+
+    return make_dictionary(lengths);
+}
+
+// Compress the data with a dictionary's code table (format version 8), with
+// the dictionary id in place of a code table
+std::vector<char>* compress_dictionary(Dictionary* dict, char* data,
+        uint64_t N) {
+    uint64_t freq[256];
+    gen_freq_table(freq, data, N);
+
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->push_back(VERSION_DICTIONARY);
+    put_varint(output, N);
+    put_int(output, dict->id, DICT_ID_BYTES);
+
+    std::vector<char>* encoded = encode(dict->codes, data, N,
+            encoded_bits(freq, dict->lengths));
+    output->insert(output->end(), encoded->begin(), encoded->end());
+    delete encoded;
+
+    return output;
+}
+
+// Read the original length and dictionary id of data compressed with a
+// dictionary. Returns the size of the header, or 0 if it is cut short.
+uint64_t read_dictionary_header(char* buffer, uint64_t N, uint64_t& length,
+        uint16_t& id) {
+    uint64_t pos = 4 + 1;
+    int read = get_varint(buffer + pos, N - pos, length);
+    if(read < 0 || N < pos + read + DICT_ID_BYTES)
+        return 0;
+    pos += read;
+    id = get_int(buffer + pos, DICT_ID_BYTES);
+    return pos + DICT_ID_BYTES;
+}
+
+// Why data compressed with a dictionary can't be decompressed with 'dict',
+// which is nullptr when there is none. Returns an empty string if it can, or
+// if the data is not compressed with a dictionary.
+std::string dictionary_problem(char* buffer, uint64_t N, Dictionary* dict) {
+    uint64_t length;
+    uint16_t id;
+    if(N < 4 + 1 || memcmp(buffer, MAGIC, 4) || buffer[4] != VERSION_DICTIONARY
+            || !read_dictionary_header(buffer, N, length, id))
+        return "";
+
+    char ids[32];
+    if(!dict) {
+        snprintf(ids, sizeof(ids), "%04x", id);
+        return std::string("compressed with dictionary ") + ids
+            + ", which has to be given with -D";
+    }
+    if(id != dict->id) {
+        snprintf(ids, sizeof(ids), "%04x, not %04x", id, dict->id);
+        return std::string("compressed with dictionary ") + ids
+            + " as given";
+    }
+    return "";
+}
+
+// Most bytes each compressed byte of a format version can decode to. Huffman
+// codes take at least a bit per byte, each LZ77 sequence at least a bit, and
+// each tANS chunk at least its two states.
+uint64_t max_expansion(char version) {
+    if(version == VERSION_LZ77)
+        return 8 * (MAX_LITERALS + MAX_MATCH);
+    if(version == VERSION_ANS || version == VERSION_CODERS)
+        return ANS_CHUNK / 3 + 1;
+    return 8;
+}
+
+// Find the original length of the data in a compressed file.
+// Returns false if the data is not a valid compressed file.
+bool decompressed_size(char* buffer, uint64_t N, uint64_t& length) {
+    if(N < 4 + 1 || memcmp(buffer, MAGIC, 4)
+            || buffer[4] < VERSION || buffer[4] > VERSION_DICTIONARY)
+        return false;
+    if(buffer[4] == VERSION_DICTIONARY) {
+        uint16_t id;
+        if(!read_dictionary_header(buffer, N, length, id))
+            return false;
+    } else {
+        if(N < 4 + 1 + 8) return false;
+        length = get_int(buffer + 5, 8);
+    }
+    // A corrupt length is caught here, before anything that size is
+    // allocated
+    return length / max_expansion(buffer[4]) <= N;
+}
+
+// Decompress any of the file formats into 'output', which has room for the
+// size given by decompressed_size(). Blocks are decoded in parallel, straight
+// into their place in the output. Data compressed with a dictionary needs the
+// same dictionary.
+// Returns false if the data is not a valid compressed file.
+bool decompress(char* buffer, uint64_t N, char* output, ThreadPool& pool,
+        Dictionary* dict=nullptr) {
+    uint64_t length;
+    if(!decompressed_size(buffer, N, length))
+        return false;
+
+    if(buffer[4] == VERSION_DICTIONARY) {
+        uint16_t id;
+        uint64_t pos = read_dictionary_header(buffer, N, length, id);
+        if(!dict || id != dict->id)
+            return false;
+        return decode(&dict->table, buffer + pos, N - pos, output, length);
+    }
+
+    if(buffer[4] == VERSION) {
+        uint64_t pos = 4 + 1 + 8;
+        int lengths[256];
+        int read = read_code_lengths(buffer + pos, N - pos, lengths);
+        if(read < 0) return false;
+        pos += read;
 
-    char buffer = 0;
-    int counter = 0;
-    int dataPos = 0;
-    int codePos = 0;
-    std::string curCode = (*codes)[data[0]];
-    while(dataPos < N) {
-        // Do we need to move to the next byte?
-        if(codePos == (int)curCode.length()) {
-            dataPos++;
-            curCode = (*codes)[data[dataPos]];
-            codePos = 0;
+        DecodeTable* table = new DecodeTable;
+        build_decode_table(table, lengths);
+        bool ok = decode(table, buffer + pos, N - pos, output, length);
+        delete table;
+
+        return ok;
+    }
+
+    if(buffer[4] == VERSION_CONTEXT) {
+        uint64_t pos = 4 + 1 + 8;
+        if(N < pos + 1 + 256) return false;
+        int ntables = (unsigned char)buffer[pos++];
+        if(ntables < 1 || ntables > MAX_CONTEXT_TABLES) return false;
+        unsigned char* map = (unsigned char*)buffer + pos;
+        if(*std::max_element(map, map + 256) >= ntables) return false;
+        pos += 256;
+
+        DecodeTable* tables = new DecodeTable[ntables];
+        for(int t=0; t<ntables; t++) {
+            int lengths[256];
+            int read = read_code_lengths(buffer + pos, N - pos, lengths);
+            if(read < 0) {
+                delete[] tables;
+                return false;
+            }
+            pos += read;
+            build_decode_table(tables + t, lengths);
         }
+        bool ok = decode_contexts(tables, map, buffer + pos, N - pos, output,
+                length);
+        delete[] tables;
 
-        // Copy bit in the code to our buffer
-        if(curCode[codePos++] == '1')
-            buffer |= 1;
-        counter++;
+        return ok;
+    }
+
+    if(buffer[4] == VERSION_ANS) {
+        uint64_t pos = 4 + 1 + 8;
+        return ans_decode(buffer + pos, N - pos, output, length);
+    }
 
-        // Do we need to flush our buffer?
-        if(counter==8) {
-            output->push_back(buffer);
-            buffer = 0;
-            counter = 0;
+    if(buffer[4] == VERSION_LZ77) {
+        uint64_t pos = 4 + 1 + 8;
+        DecodeTable* tables = new DecodeTable[LZ_TABLES];
+        for(int t=0; t<LZ_TABLES; t++) {
+            int lengths[256];
+            int read = read_code_lengths(buffer + pos, N - pos, lengths);
+            if(read < 0) {
+                delete[] tables;
+                return false;
+            }
+            pos += read;
+            build_decode_table(tables + t, lengths);
         }
-        
-        // Move to next bit in buffer
-        buffer <<= 1;
+        bool ok = decode_lz77(tables, buffer + pos, N - pos, output, length);
+        delete[] tables;
+
+        return ok;
     }
 
-    // Flush any remaining data
-    output->push_back(buffer);
+    BlockHeader header;
+    int read = read_block_header(buffer, N, header);
+    if(read < 0) return false;
+    uint64_t pos = read;
+    uint64_t blockSize = header.blockSize;
 
-    return output;
+    // Turn the block index into offsets of each block in the buffer
+    uint64_t nblocks = (length + blockSize - 1) / blockSize;
+    if((N - pos) / 8 < nblocks) return false;
+    std::vector<uint64_t> offsets(nblocks + 1);
+    offsets[0] = pos + 8*nblocks;
+    for(uint64_t b=0; b<nblocks; b++) {
+        offsets[b+1] = offsets[b] + get_int(buffer + pos + 8*b, 8);
+        if(offsets[b+1] < offsets[b] || offsets[b+1] > N) return false;
+    }
+
+    std::atomic<bool> ok{true};
+    pool.parallel_for(nblocks, [&](int b) {
+        uint64_t expected = std::min(blockSize, length - b*blockSize);
+        if(!decode_block(buffer + offsets[b], offsets[b+1] - offsets[b],
+                header, output + b*blockSize, expected))
+            ok = false;
+    });
+
+    return ok;
 }
 
-std::vector<char>* decode(TreeNode* hfTree, char* buffer, int N) {
-    std::vector<char>* output = new std::vector<char>;
+// Compress a stream of N bytes in the block format, holding only one batch
+// of blocks (one per thread) in memory at a time. The block index is written
+// as zeros and filled in at the end, so the output has to be seekable.
+//
+// With 'format.shared' set the input is read twice: once to build the shared
+// code table, and again to encode it.
+bool compress_stream(std::istream& is, uint64_t N, std::ostream& os,
+        BlockHeader& format, LengthLimit& limit, ThreadPool& pool) {
+    uint64_t blockSize = format.blockSize;
+    uint64_t nblocks = (N + blockSize - 1) / blockSize;
+    int batch = pool.workers.size() + 1;
+    // A batch is never more than the whole input
+    std::vector<char> input(std::min(batch * blockSize, N));
 
-    TreeNode* curNode = hfTree;
-    int i = 0;
-    int bitIdx = 7;
-    while(i < N) {
-        // Test bit 'bitIdx' and traverse tree accordingly
-        if(buffer[i] & (1<<bitIdx--))
-            curNode = curNode->right;
-        else
-            curNode = curNode->left;
-        
-        // Do we need to move to the next byte in our data?
-        if(bitIdx < 0) {
-            i++;
-            bitIdx = 7;
+    format.length = N;
+    uint64_t sharedBits = 0;
+    if(format.shared) {
+        uint64_t freq[256] = {0}, chunk[256];
+        for(uint64_t done=0; done<N; done+=input.size()) {
+            uint64_t n = std::min<uint64_t>(input.size(), N - done);
+            if(!is.read(input.data(), n))
+                return false;
+            gen_freq_table(chunk, input.data(), n);
+            for(int s=0; s<256; s++)
+                freq[s] += chunk[s];
+        }
+        sharedBits = huffman_code_lengths_from(format.lengths, freq, limit);
+        is.clear();
+        is.seekg(0, is.beg);
+    }
+
+    std::vector<char> header;
+    write_block_header(&header, format);
+    os.write(header.data(), header.size());
+    std::streampos indexPos = os.tellp();
+    std::vector<char> index(8*nblocks);
+    os.write(index.data(), index.size());
+    index.clear();
+
+    std::vector<std::vector<char>*> blocks(batch);
+    for(uint64_t first=0; first<nblocks; first+=batch) {
+        int count = std::min((uint64_t)batch, nblocks - first);
+        uint64_t size = std::min(count*blockSize, N - first*blockSize);
+        {
+            STAT_PHASE(PHASE_IO);
+            if(!is.read(input.data(), size))
+                return false;
         }
 
-        // Have we found a leaf in our tree?
-        if(curNode->c != 0) {
-            if(curNode->c == END_TEXT)
-                return output;
-            output->push_back(curNode->c);
-            curNode = hfTree;
+        pool.parallel_for(count, [&](int b) {
+            uint64_t start = b*blockSize;
+            uint64_t len = std::min(blockSize, size - start);
+            blocks[b] = encode_block(input.data() + start, len, format,
+                    (double)sharedBits / N * len, limit);
+        });
+
+        STAT_PHASE(PHASE_IO);
+        for(int b=0; b<count; b++) {
+            put_int(&index, blocks[b]->size(), 8);
+            os.write(blocks[b]->data(), blocks[b]->size());
+            delete blocks[b];
         }
     }
 
-    return output;
+    os.seekp(indexPos);
+    os.write(index.data(), index.size());
+    return (bool)os;
 }
 
-// Create lookup table of codes associated with each symbol.
-void gen_huffman_codes(std::map<char,std::string>* codes,
-        TreeNode* root, std::string code="") {
-    if(!root) return;
+// Decompress a stream in the block format a batch of blocks at a time.
+// Returns false if the data is not a valid compressed file. Files in the
+// single stream format have to be decoded in memory.
+bool decompress_stream(std::istream& is, std::ostream& os, ThreadPool& pool) {
+    // Read the fixed part of the header, then the shared table if any
+    std::vector<char> raw(4 + 1 + 8 + 4 + 1);
+    if(!is.read(raw.data(), raw.size()))
+        return false;
+    if(raw[4] == VERSION_STREAMS || raw[4] == VERSION_CODERS) {
+        raw.push_back(0);
+        if(!is.read(&raw.back(), 1)) return false;
+    }
+    if(raw[17]) {
+        raw.resize(raw.size() + 32);
+        if(!is.read(raw.data() + raw.size() - 32, 32)) return false;
+        int present = 0;
+        for(int i=0; i<32; i++)
+            present += __builtin_popcount((unsigned char)raw[raw.size()-32+i]);
+        raw.resize(raw.size() + present);
+        if(!is.read(raw.data() + raw.size() - present, present)) return false;
+    }
+
+    BlockHeader header;
+    if(read_block_header(raw.data(), raw.size(), header) < 0)
+        return false;
+    uint64_t length = header.length;
+    uint64_t blockSize = header.blockSize;
+
+    // The index and the blocks have to fit in the rest of the stream
+    std::streampos start = is.tellg();
+    is.seekg(0, is.end);
+    std::streampos end = is.tellg();
+    is.seekg(start);
+    if(start < 0 || end < start) return false;
+    uint64_t left = end - start;
+
+    uint64_t nblocks = (length + blockSize - 1) / blockSize;
+    if(left / 8 < nblocks || length / max_expansion(raw[4]) > left)
+        return false;
+    std::vector<char> index(8*nblocks);
+    if(!is.read(index.data(), index.size()))
+        return false;
+    left -= index.size();
+
+    int batch = pool.workers.size() + 1;
+    std::vector<char> input, output(std::min(batch * blockSize, length));
+    std::vector<uint64_t> offsets(batch + 1);
+    for(uint64_t first=0; first<nblocks; first+=batch) {
+        int count = std::min((uint64_t)batch, nblocks - first);
+        for(int b=0; b<count; b++) {
+            offsets[b+1] = offsets[b] + get_int(&index[8*(first+b)], 8);
+            if(offsets[b+1] < offsets[b] || offsets[b+1] > left)
+                return false;
+        }
+        left -= offsets[count];
+        input.resize(offsets[count]);
+        {
+            STAT_PHASE(PHASE_IO);
+            if(!is.read(input.data(), input.size()))
+                return false;
+        }
 
-    // We have found a leaf (or symbol) in our tree.
-    // We can now finish our current code.
-    if(root->c != 0)
-        codes->insert({root->c, code});
+        uint64_t size = std::min(count*blockSize, length - first*blockSize);
+        std::atomic<bool> ok{true};
+        pool.parallel_for(count, [&](int b) {
+            uint64_t start = b*blockSize;
+            if(!decode_block(input.data() + offsets[b],
+                    offsets[b+1] - offsets[b], header,
+                    output.data() + start, std::min(blockSize, size - start)))
+                ok = false;
+        });
+        if(!ok) return false;
+
+        STAT_PHASE(PHASE_IO);
+        os.write(output.data(), size);
+    }
 
-    // Traversing left is represented as a '0' in the binary code, while
-    // traversing right is represented as a '1'.
-    gen_huffman_codes(codes, root->left, code + '0');
-    gen_huffman_codes(codes, root->right, code + '1');
+    return (bool)os;
 }
 
-TreeNode* build_huffman_tree(std::map<char,int>* freq) {
-    // MinHeap built on frequency
-    std::priority_queue<TreeNode*, std::vector<TreeNode*>, CompareTreeNode> PQ;
+// The Huffman coder behind the common Codec interface. Streams are compressed
+// in the block format, with 1 MiB blocks unless another size is given, so
+// order-1 contexts and LZ77 only apply to buffers compressed without blocks.
+struct HuffmanCodec : Codec {
+    BlockHeader format;
+    bool contexts;
+    int lzLevel, lzWindowBits;
+    LengthLimit limit;
+    Dictionary* dict;
+    ThreadPool pool;
 
-    // Initialize leaf node for each char
-    for(auto &[c,f] : *freq)
-        PQ.push(new TreeNode(c,f));
+    HuffmanCodec(const CodecOptions& options, Dictionary* dict)
+            : contexts(options.contexts), lzLevel(options.lzLevel),
+            lzWindowBits(options.lzWindowBits), dict(dict),
+            pool(options.threads) {
+        format.blockSize = options.blockSize;
+        format.streams = options.streams;
+        format.shared = options.shared;
+        format.coder = options.coder;
+        limit.maxLen = options.maxCodeLen;
 
-    // Tree merging step
-    while((int)PQ.size() > 1) {
-        // Grab the 2 lowest frequency nodes
-        TreeNode* left = PQ.top();
-        PQ.pop();
+        // Interleaved streams always use the block format
+        if(format.streams > 1 && format.blockSize == 0)
+            format.blockSize = 1 << 20;
+    }
 
-        TreeNode* right = PQ.top();
-        PQ.pop();
+    ~HuffmanCodec() {
+        delete dict;
+    }
 
-        // Merge them together with combined frequency
-        TreeNode* parent = new TreeNode(0, left->freq + right->freq);
-        parent->left = left;
-        parent->right = right;
-        PQ.push(parent);
+    std::vector<char>* compress(char* data, uint64_t N) {
+        if(dict)
+            return compress_dictionary(dict, data, N);
+        BlockHeader header = format;
+        if(header.blockSize > 0)
+            return compress_blocks(data, N, header, limit, pool);
+        if(lzLevel > 0)
+            return compress_lz77(data, N, lzLevel, lzWindowBits, limit);
+        if(contexts)
+            return compress_contexts(data, N, limit);
+        return compress_coder(data, N, format.coder, limit);
     }
-    
-    // Remaining node is root of huffman tree
-    return PQ.top();
+
+    std::vector<char>* decompress(char* data, uint64_t N) {
+        uint64_t length;
+        if(!decompressed_size(data, N, length))
+            return nullptr;
+
+        // The length can still be more than there is memory for
+        std::vector<char>* output;
+        try {
+            output = new std::vector<char>(length);
+        } catch(const std::bad_alloc&) {
+            return nullptr;
+        }
+        if(!huffman::decompress(data, N, output->data(), pool, dict)) {
+            delete output;
+            return nullptr;
+        }
+        return output;
+    }
+
+    bool compress(std::istream& is, std::ostream& os) {
+        is.seekg(0, is.end);
+        std::streampos N = is.tellg();
+        is.seekg(0, is.beg);
+        if(N < 0) return false;
+
+        // Dictionary data has no blocks, so it is compressed in memory
+        if(dict) {
+            std::vector<char> input(std::istreambuf_iterator<char>(is), {});
+            std::vector<char>* output = compress(input.data(), input.size());
+            os.write(output->data(), output->size());
+            delete output;
+            return (bool)os;
+        }
+
+        BlockHeader header = format;
+        if(header.blockSize == 0)
+            header.blockSize = 1 << 20;
+        return compress_stream(is, N, os, header, limit, pool);
+    }
+
+    bool decompress(std::istream& is, std::ostream& os) {
+        char version[5];
+        is.read(version, 5);
+        is.seekg(0, is.beg);
+        if(!is) return false;
+        if(is_block_version(version[4])) {
+            // The header can still ask for more than there is memory for
+            try {
+                return decompress_stream(is, os, pool);
+            } catch(const std::bad_alloc&) {
+                return false;
+            }
+        }
+
+        // The single stream format has to be decoded in memory
+        std::vector<char> input(std::istreambuf_iterator<char>(is), {});
+        std::vector<char>* output = decompress(input.data(), input.size());
+        if(!output) return false;
+        os.write(output->data(), output->size());
+        delete output;
+        return (bool)os;
+    }
+};
+
+} // namespace huffman
+
+Codec* new_huffman_codec(const CodecOptions& options) {
+    huffman::Dictionary* dict = nullptr;
+    if(!options.dictionary.empty()) {
+        dict = huffman::load_dictionary(options.dictionary.c_str());
+        if(!dict) return nullptr;
+    }
+    return new huffman::HuffmanCodec(options, dict);
 }
 
-// Create frequency table for each character in the input file
-std::map<char,int>* gen_freq_table(char* buffer, int N) {
-    std::map<char,int>* M = new std::map<char,int>;
+bool train_huffman_dictionary(const std::vector<std::string>& samples,
+        const std::string& filename, int maxCodeLen) {
+    std::vector<MappedFile*> files;
+    bool ok = true;
+    for(const std::string& name : samples) {
+        files.push_back(new MappedFile);
+        if(!files.back()->open_read(name.c_str()))
+            ok = false;
+    }
 
-    for(int i=0; i<N; i++) {
-        (*M)[buffer[i]]++;
+    if(ok) {
+        huffman::LengthLimit limit;
+        limit.maxLen = maxCodeLen;
+        huffman::Dictionary* dict = huffman::train_dictionary(files, limit);
+        ok = huffman::save_dictionary(dict, filename.c_str());
+        delete dict;
     }
+    for(MappedFile* file : files)
+        delete file;
+    return ok;
+}
 
-    return M;
+std::string check_huffman_dictionary(const CodecOptions& options, char* data,
+        uint64_t N) {
+    huffman::Dictionary* dict = nullptr;
+    if(!options.dictionary.empty())
+        dict = huffman::load_dictionary(options.dictionary.c_str());
+    std::string problem = huffman::dictionary_problem(data, N, dict);
+    delete dict;
+    return problem;
 }
 
-int main (int argc, char *argv[]) {
-    if(argc < 2) {
-        std::cerr << "no filename provided" << std::endl;
-        return -1;
+bool parse_entropy_coder(const std::string& name, EntropyCoder& coder) {
+    if(name == "huffman")
+        coder = CODER_HUFFMAN;
+    else if(name == "ans")
+        coder = CODER_ANS;
+    else if(name == "best")
+        coder = CODER_BEST;
+    else
+        return false;
+    return true;
+}
+
+std::string check_huffman_options(const CodecOptions& options,
+        bool streaming) {
+    using namespace huffman;
+    if(options.streams != 1 && options.streams != 2 && options.streams != 4
+            && options.streams != 8)
+        return "number of streams must be 1, 2, 4 or 8";
+    // 8 bits is enough room for all 256 symbols
+    if(options.maxCodeLen < 8 || options.maxCodeLen > MAX_CODE_LEN)
+        return "max code length must be between 8 and "
+            + std::to_string(MAX_CODE_LEN);
+    // The header holds the block size in 4 bytes
+    if(options.blockSize >= 1ULL << 32)
+        return "block size must be under 4 GiB";
+    if(options.contexts && (options.blockSize > 0 || options.streams > 1
+                || streaming))
+        return "order-1 contexts can't be combined with -b, -i or -m";
+    if(options.lzLevel < 0 || options.lzLevel > MAX_LEVEL)
+        return "LZ77 level must be between 1 and " + std::to_string(MAX_LEVEL);
+    if(options.lzWindowBits < MIN_WINDOW_BITS
+            || options.lzWindowBits > MAX_WINDOW_BITS)
+        return "LZ77 window must be between " + std::to_string(MIN_WINDOW_BITS)
+            + " and " + std::to_string(MAX_WINDOW_BITS) + " bits";
+    if(options.lzLevel > 0 && (options.blockSize > 0 || options.streams > 1
+                || streaming || options.contexts))
+        return "LZ77 can't be combined with -b, -i, -m or -x";
+    if(options.coder != CODER_HUFFMAN && (options.shared || options.contexts
+                || options.lzLevel > 0))
+        return "tANS can't be combined with -s, -x or -z";
+    if(!options.dictionary.empty() && (options.blockSize > 0
+                || options.streams > 1 || streaming || options.contexts
+                || options.lzLevel > 0 || options.coder != CODER_HUFFMAN))
+        return "a dictionary can't be combined with -b, -i, -m, -x, -z or -e";
+    return "";
+}
+
+#ifndef CODEC_LIBRARY
+using namespace huffman;
+
+// Decode a compressed file on its own, using only what is in its header.
+// The compressed file is mapped into memory and decoded straight into a
+// mapping of the output file. With 'streaming' set, files in the block format
+// are instead decoded a batch of blocks at a time through stream buffers.
+int decompress_file(const char* filename, const char* outname,
+        ThreadPool& pool, bool streaming, Dictionary* dict) {
+    if(streaming) {
+        std::ifstream ifs(filename, std::ios::binary);
+        if(!ifs) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+
+        char version[5];
+        ifs.read(version, 5);
+        ifs.seekg(0, ifs.beg);
+        if(ifs && is_block_version(version[4])) {
+            std::ofstream ofs(outname, std::ios::out | std::ios::binary);
+            bool ok;
+            try {
+                ok = decompress_stream(ifs, ofs, pool);
+            } catch(const std::bad_alloc&) {
+                ok = false;
+            }
+            if(!ok) {
+                std::cerr << "not a compressed huffman file" << std::endl;
+                return -1;
+            }
+            return 0;
+        }
     }
-    
-    // Open file
-    std::ifstream ifs(argv[1], std::ios::binary | std::ios::ate);
-    if(!ifs) {
+
+    MappedFile input;
+    if(!input.open_read(filename)) {
         std::cerr << "error opening file" << std::endl;
         return -1;
     }
 
-    // Determine length
-    int data_size = ifs.tellg();
-    ifs.seekg(0, ifs.beg);
+    uint64_t length;
+    if(!decompressed_size(input.data, input.size, length)) {
+        std::cerr << "not a compressed huffman file" << std::endl;
+        return -1;
+    }
+    std::string problem = dictionary_problem(input.data, input.size, dict);
+    if(!problem.empty()) {
+        std::cerr << problem << std::endl;
+        return -1;
+    }
+
+    MappedFile output;
+    if(!output.open_write(outname, length)) {
+        std::cerr << "error opening file" << std::endl;
+        return -1;
+    }
 
-    // Read data
-    char* buffer = new char[data_size+1];
-    ifs.read(buffer, data_size);
-    buffer[data_size] = END_TEXT; // Insert ASCII 3 as psuedo-sybol for EOF
-    ifs.close();
+    if(!decompress(input.data, input.size, output.data, pool, dict)) {
+        std::cerr << "not a compressed huffman file" << std::endl;
+        return -1;
+    }
 
-    std::cout << "Compressing file..." << std::endl;
+    return 0;
+}
 
-    // Generate frequency table
-    std::map<char,int>* freq_table;
-    freq_table = gen_freq_table(buffer, data_size+1);
+void usage() {
+    std::cerr << "usage: Huffman [-b block KiB] [-s] [-i streams] [-t threads] "
+                 "[-l max code bits] [-m] [-x] [-z LZ77 level] "
+                 "[-W LZ77 window bits] [-e huffman|ans|best] "
+                 "[-D dictionary] <file>\n"
+              << "       Huffman [-m | -D dictionary] -d <compressed file>"
+              << std::endl;
+}
 
-    // Create the huffman coding tree and code table
-    TreeNode* HuffmanTree = build_huffman_tree(freq_table);
-    std::map<char,std::string>* Codes = new std::map<char,std::string>;
-    gen_huffman_codes(Codes, HuffmanTree);
+int main (int argc, char *argv[]) {
+    STAT_START("Huffman");
+    // Block mode is off unless a block size is given
+    CodecOptions options;
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+    bool streaming = false;
+    std::string coderName = "huffman";
+    char* decompressName = nullptr;
 
+    int opt;
+    while((opt = getopt(argc, argv, "b:d:D:e:i:l:mst:W:xz:")) != -1) {
+        switch(opt) {
+            case 'b': options.blockSize = atoll(optarg) * 1024; break;
+            case 'd': decompressName = optarg; break;
+            case 'D': options.dictionary = optarg; break;
+            case 'e': coderName = optarg; break;
+            case 'i': options.streams = atoi(optarg); break;
+            case 'l': options.maxCodeLen = atoi(optarg); break;
+            case 'm': streaming = true; break;
+            case 's': options.shared = true; break;
+            case 't': options.threads = std::max(1, atoi(optarg)); break;
+            case 'W': options.lzWindowBits = atoi(optarg); break;
+            case 'x': options.contexts = true; break;
+            case 'z': options.lzLevel = atoi(optarg); break;
+            default: usage(); return -1;
+        }
+    }
+    if(!parse_entropy_coder(coderName, options.coder)) {
+        std::cerr << "unknown entropy coder: " << coderName << std::endl;
+        return -1;
+    }
+    std::string error = check_huffman_options(options, streaming);
+    if(!error.empty()) {
+        std::cerr << error << std::endl;
+        return -1;
+    }
 
-    // Encode file
-    std::clock_t encode_start = std::clock();
-    std::vector<char>* encoded = encode(Codes, buffer, data_size+1);
-    double encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+    BlockHeader format;
+    format.blockSize = options.blockSize;
+    format.streams = options.streams;
+    format.shared = options.shared;
+    format.coder = options.coder;
+    LengthLimit limit;
+    limit.maxLen = options.maxCodeLen;
+    bool contexts = options.contexts;
+    int lzLevel = options.lzLevel, lzWindowBits = options.lzWindowBits;
+    int threads = options.threads;
 
-    std::cout << "Writing to disk..." << std::endl;
+    // The dictionary is loaded once, with its code and decode tables
+    Dictionary* dict = nullptr;
+    const char* dictName = options.dictionary.c_str();
+    if(!options.dictionary.empty() && !(dict = load_dictionary(dictName))) {
+        std::cerr << "error loading dictionary " << dictName << std::endl;
+        return -1;
+    }
 
-    // Write compressed data to file
-    std::ofstream ofs("compr_huffman.dat", std::ios::out | std::ios::binary);
-    ofs.write(encoded->data(), encoded->size());
-    ofs.flush();
+    ThreadPool pool(threads);
+    if(decompressName) {
+        int status = decompress_file(decompressName, "orig_huffman.txt", pool,
+                streaming, dict);
+        delete dict;
+        return status;
+    }
 
-    // Open compressed file
-    ifs.open("compr_huffman.dat",
-            std::ios::in | std::ios::binary | std::ios::ate);
-    if(!ifs) {
-        std::cerr << "error opening file" << std::endl;
+    if(optind >= argc) {
+        std::cerr << "no filename provided" << std::endl;
+        usage();
         return -1;
     }
+    char* filename = argv[optind];
+    
+    // Streaming and interleaved streams always use the block format
+    if((streaming || format.streams > 1) && format.blockSize == 0)
+        format.blockSize = 1 << 20;
+
+    uint64_t data_size, data_size2;
+    MappedFile input, output;
+    std::vector<char>* encoded = nullptr;
+    double encode_time, decode_time;
+    bool matching = true;
 
-    // Determine length
-    int data_size2 = ifs.tellg();
-    ifs.seekg(0, ifs.beg);
+    if(streaming) {
+        std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+        if(!ifs) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+        data_size = ifs.tellg();
+        ifs.seekg(0, ifs.beg);
+
+        std::cout << "Compressing file..." << std::endl;
+
+        // Encode file straight to disk
+        std::ofstream ofs("compr_huffman.dat",
+                std::ios::out | std::ios::binary);
+        std::clock_t encode_start = std::clock();
+        if(!compress_stream(ifs, data_size, ofs, format, limit, pool)) {
+            std::cerr << "error compressing file" << std::endl;
+            return -1;
+        }
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        ofs.seekp(0, ofs.end);
+        data_size2 = ofs.tellp();
+        ofs.close();
 
-    // Read data
-    char* buffer2 = new char[data_size2];
-    ifs.read(buffer2, data_size2);
-    ifs.close();
+        std::cout << "Decompressing file..." << std::endl;
 
-    std::cout << "Decompressing file..." << std::endl; 
+        // Decode file straight to disk
+        std::clock_t decode_start = std::clock();
+        if(decompress_file("compr_huffman.dat", "orig_huffman.txt", pool, true,
+                    nullptr))
+            return -1;
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
 
-    // Decode file
-    std::clock_t decode_start = std::clock();
-    std::vector<char>* decoded = decode(HuffmanTree, buffer2, data_size2);
-    double decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+        std::cout << "Testing files..." << std::endl;
  
-    std::cout << "Testing files..." << std::endl;
+        // Check for inconsistencies
+        matching = files_match(filename, "orig_huffman.txt");
+    } else {
+        // Map the file into memory
+        if(!input.open_read(filename)) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+        data_size = input.size;
 
-    // Check for inconsistencies
-    bool matching = true;
-    for(int i=0; i<data_size; i++) {
-        if(buffer[i] != (*decoded)[i]) {
-            matching = false;
-            break;
+        std::cout << "Compressing file..." << std::endl;
+
+        // Build the code table(s) and encode file
+        std::clock_t encode_start = std::clock();
+        if(dict)
+            encoded = compress_dictionary(dict, input.data, data_size);
+        else if(format.blockSize > 0)
+            encoded = compress_blocks(input.data, data_size, format, limit,
+                    pool);
+        else if(lzLevel > 0)
+            encoded = compress_lz77(input.data, data_size, lzLevel,
+                    lzWindowBits, limit);
+        else if(contexts)
+            encoded = compress_contexts(input.data, data_size, limit);
+        else
+            encoded = compress_coder(input.data, data_size, format.coder,
+                    limit);
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        data_size2 = encoded->size();
+
+        std::cout << "Writing to disk..." << std::endl;
+
+        // Write compressed data to file
+        if(!write_mapped("compr_huffman.dat", encoded->data(), data_size2)) {
+            std::cerr << "error writing file" << std::endl;
+            return -1;
+        }
+
+        std::cout << "Decompressing file..." << std::endl; 
+
+        // Decode the compressed data still in memory straight into a mapping
+        // of the output file, rebuilding the code tables from the data alone
+        uint64_t length;
+        if(!decompressed_size(encoded->data(), data_size2, length)
+                || !output.open_write("orig_huffman.txt", length)) {
+            std::cerr << "error reading compressed file" << std::endl;
+            return -1;
         }
+        std::clock_t decode_start = std::clock();
+        bool decoded = decompress(encoded->data(), data_size2, output.data,
+                pool, dict);
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+        if(!decoded) {
+            std::cerr << "error reading compressed file" << std::endl;
+            return -1;
+        }
+     
+        std::cout << "Testing files..." << std::endl;
+
+        // Check for inconsistencies
+        matching = length == data_size
+            && (data_size == 0 || !memcmp(input.data, output.data, data_size));
     }
 
     // Display results
@@ -279,6 +2654,13 @@ int main (int argc, char *argv[]) {
                 << "Reduction: " << "| " << std::fixed << std::setprecision(2)
                 << 100 - ((double)data_size2 / data_size) * 100 << "%"
                 << std::endl;
+        if(limit.maxLen < MAX_CODE_LEN)
+            std::cout << std::left << std::setw(22)
+                    << "Length limit loss: " << "| " << std::fixed
+                    << std::setprecision(2) << (limit.optimalBits
+                        ? 100.0 * limit.limitedBits / limit.optimalBits - 100
+                        : 0.0)
+                    << "% (" << limit.maxLen << " bits)\n";
         std::cout << "======================================\n";
         std::cout << "Encoding Duration: " 
                 << std::fixed << std::setprecision(2) << encode_time << "s\n";
@@ -287,33 +2669,11 @@ int main (int argc, char *argv[]) {
         std::cout<<std::endl;
     }
 
-    // Write decoded file to disk
-    ofs.close();
-    ofs.open("orig_huffman.txt",
-            std::ios::out | std::ios::binary);
-    ofs.write(decoded->data(), decoded->size());
-    ofs.flush();
-    ofs.close();
-
     // Clean up
-    delete[] buffer;
-    delete[] buffer2;
-    delete freq_table;
-    delete Codes;
     delete encoded;
-    delete decoded;
-
-    std::stack<TreeNode*> S;
-    S.push(HuffmanTree);
-    while(!S.empty()) {
-        TreeNode* cur = S.top();
-        S.pop();
-
-        if(cur->left) S.push(cur->left);
-        if(cur->right) S.push(cur->right);
-
-        delete cur;
-    }
+    delete dict;
 
     return 0;
 }
+
+#endif
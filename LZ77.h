@@ -0,0 +1,239 @@
+// LZ77 Match Finder
+//
+// Front end of the Huffman codec's LZ77 format. The input is split into
+// sequences, each a run of literal bytes followed by a copy of earlier data:
+// 'matchLen' bytes starting 'dist' bytes back, where the copy may overlap
+// the bytes it produces. The Huffman stage then codes the literals, lengths
+// and distances.
+//
+// Matches are found with hash chains. Every position is hashed on its next
+// MIN_MATCH bytes, the hash table holds the latest position with each hash,
+// and a ring of links as large as the window leads from each position to the
+// previous one with the same hash. The level sets how far down a chain to
+// look and whether to check if the match one byte later is longer before
+// taking a match (lazy matching); the lowest levels also skip ahead through
+// data that doesn't match.
+
+#ifndef LZ77_H
+#define LZ77_H
+
+#include <bits/stdc++.h>
+
+#include "Stats.h"
+
+const int MIN_MATCH = 4;
+
+// Longest literal run and match of one sequence, so their lengths fit the
+// Huffman stage's length codes. Longer runs are split over several sequences.
+const int MAX_LITERALS = 2047;
+const int MAX_MATCH = MIN_MATCH - 1 + 2047;
+
+// Positions are kept as 32-bit offsets, so longer inputs are parsed a segment
+// at a time, and matches don't reach back across segments
+const uint64_t LZ_SEGMENT = 1ULL << 30;
+
+const int MAX_LEVEL = 9;
+const int MIN_WINDOW_BITS = 10;
+const int MAX_WINDOW_BITS = 24;
+
+// A run of literals followed by a match, or no match when matchLen is 0
+struct Sequence {
+    uint32_t literals;
+    uint32_t matchLen;
+    uint32_t dist;
+};
+
+// Search settings of each level
+struct LevelParams {
+    int chain;      // most chain links followed per position
+    int good;       // length after which only a quarter of them are followed
+    int nice;       // length at which a match is taken without looking further
+    bool lazy;      // look for a longer match at the next position first
+    bool skip;      // speed up through data without matches
+};
+
+const LevelParams LEVELS[MAX_LEVEL + 1] = {
+    {0, 0, 0, false, false},
+    {1, 8, 16, false, true},
+    {4, 8, 32, false, true},
+    {8, 8, 64, false, false},
+    {8, 8, 32, true, false},
+    {16, 8, 64, true, false},
+    {32, 16, 128, true, false},
+    {48, 16, 192, true, false},
+    {64, 32, 256, true, false},
+    {128, 32, 512, true, false}
+};
+
+struct MatchFinder {
+    // The hash table grows with the window, up to 2^MAX_HASH_BITS entries,
+    // so chains hold few positions that only share a hash. The fastest
+    // levels follow too few links for that to matter, and keep a table
+    // small enough to stay in cache.
+    static const int MAX_HASH_BITS = 20;
+    static const int FAST_HASH_BITS = 16;
+    static const uint32_t TOO_FAR = 4096;
+
+    const unsigned char* data;
+    uint64_t N;
+    LevelParams params;
+    uint32_t window, mask;
+    int hashBits;
+    std::vector<int32_t> head, prev;
+    std::vector<Sequence>* output;
+
+    MatchFinder(char* buffer, uint64_t N, int level, int windowBits,
+            std::vector<Sequence>* output)
+        : data((unsigned char*)buffer), N(N), params(LEVELS[level]),
+          window(1u << windowBits), mask(window - 1),
+          hashBits(std::min(windowBits,
+                  params.skip ? FAST_HASH_BITS : MAX_HASH_BITS)),
+          head(1 << hashBits), prev(window), output(output) {};
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    uint32_t hash(const unsigned char* p) {
+        return read32(p) * 2654435761u >> (32 - hashBits);
+    }
+
+    // Length of the common prefix of a and b, up to 'limit' bytes
+    static uint32_t match_length(const unsigned char* a, const unsigned char* b,
+            uint32_t limit) {
+        uint32_t len = 0;
+        while(len + 8 <= limit) {
+            uint64_t x, y;
+            memcpy(&x, a + len, 8);
+            memcpy(&y, b + len, 8);
+            if(x != y)
+                return len + (__builtin_ctzll(x ^ y) >> 3);
+            len += 8;
+        }
+        while(len < limit && a[len] == b[len])
+            len++;
+        return len;
+    }
+
+    // Add position p of the segment starting at 'base' to the hash chains
+    void insert(const unsigned char* base, int32_t p) {
+        uint32_t h = hash(base + p);
+        prev[p & mask] = head[h];
+        head[h] = p;
+    }
+
+    // Longest match for position p among the earlier positions with the same
+    // hash. Returns its length, or 0 if there is none longer than 'shortest',
+    // which is at least MIN_MATCH - 1.
+    uint32_t find(const unsigned char* base, int32_t p, uint32_t limit,
+            uint32_t& dist, uint32_t shortest = MIN_MATCH - 1) {
+        if(shortest >= limit) return 0;
+        uint32_t best = shortest;
+        int32_t cand = head[hash(base + p)];
+        int chain = params.chain;
+        // Only a quick look is worth it to improve on a good match
+        if(best >= (uint32_t)params.good)
+            chain = (chain + 3) / 4;
+        for(; chain>0 && cand >= 0; chain--) {
+            if((uint32_t)(p - cand) >= window) break;
+            // A longer match has to agree at the byte just past the best one
+            if(base[cand + best] == base[p + best]
+                    && read32(base + cand) == read32(base + p)) {
+                uint32_t len = match_length(base + cand, base + p, limit);
+                // The shortest matches only pay for their distance when
+                // they are close
+                if(len == MIN_MATCH && (uint32_t)(p - cand) > TOO_FAR)
+                    len = 0;
+                if(len > best) {
+                    uint32_t good = params.good;
+                    if(best < good && len >= good)
+                        chain = (chain + 3) / 4;
+                    best = len;
+                    dist = p - cand;
+                    // Nothing can beat a match that runs to the limit
+                    if(len >= (uint32_t)params.nice || len == limit) break;
+                }
+            }
+            int32_t next = prev[cand & mask];
+            // Links older than the window have been overwritten
+            if(next >= cand) break;
+            cand = next;
+        }
+        return best > shortest ? best : 0;
+    }
+
+    void emit(uint64_t literals, uint32_t matchLen, uint32_t dist) {
+        while(literals > MAX_LITERALS) {
+            output->push_back({MAX_LITERALS, 0, 0});
+            literals -= MAX_LITERALS;
+        }
+        output->push_back({(uint32_t)literals, matchLen, dist});
+    }
+
+    void parse_segment(const unsigned char* base, int32_t size) {
+        std::fill(head.begin(), head.end(), -1);
+        // Positions from here on have a full MIN_MATCH bytes to hash
+        int32_t last = size - MIN_MATCH;
+        int32_t p = 0, literalStart = 0;
+
+        while(p <= last) {
+            uint32_t limit = std::min<int64_t>(MAX_MATCH, size - p);
+            uint32_t dist = 0;
+            uint32_t len = find(base, p, limit, dist);
+            insert(base, p);
+
+            if(!len) {
+                p += params.skip ? 1 + ((p - literalStart) >> 5) : 1;
+                continue;
+            }
+
+            // Move on a byte at a time while that gives a longer match
+            while(params.lazy && len < (uint32_t)params.nice && p < last) {
+                uint32_t nextDist = 0;
+                uint32_t nextLimit = std::min<int64_t>(MAX_MATCH, size - p - 1);
+                uint32_t nextLen = find(base, p + 1, nextLimit, nextDist, len);
+                if(!nextLen) break;
+                p++;
+                insert(base, p);
+                len = nextLen;
+                dist = nextDist;
+            }
+
+            emit(p - literalStart, len, dist);
+
+            // The fastest levels leave the positions inside matches out
+            int32_t end = p + len;
+            if(!params.skip)
+                for(int32_t q=p+1; q<end && q<=last; q++)
+                    insert(base, q);
+            p = literalStart = end;
+        }
+
+        if(literalStart < size)
+            emit(size - literalStart, 0, 0);
+    }
+
+    void parse() {
+        for(uint64_t start=0; start<N; start+=LZ_SEGMENT)
+            parse_segment(data + start, std::min(LZ_SEGMENT, N - start));
+    }
+};
+
+// Split the data into sequences of literals and matches at most 2^windowBits
+// bytes back, searching as hard as the level (1 to MAX_LEVEL) asks
+inline std::vector<Sequence>* lz77_parse(char* data, uint64_t N, int level,
+        int windowBits) {
+    STAT_PHASE(PHASE_LZ77_PARSE);
+    std::vector<Sequence>* output = new std::vector<Sequence>;
+    // No match can reach back further than the data goes
+    while(windowBits > MIN_WINDOW_BITS && (1ULL << (windowBits - 1)) >= N)
+        windowBits--;
+
+    MatchFinder finder(data, N, level, windowBits, output);
+    finder.parse();
+    return output;
+}
+
+#endif
@@ -0,0 +1,93 @@
+// Memory Mapped File I/O
+//
+// Shared by the compression programs to get file contents in and out of
+// memory without copying them through stream buffers. Input files are mapped
+// read-only, so the data is read straight out of the page cache. Output files
+// are created at their final size and mapped read-write, so results can be
+// produced directly into them.
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Stats.h"
+
+struct MappedFile {
+    char* data = nullptr;
+    uint64_t size = 0;
+    int fd = -1;
+
+    MappedFile() {};
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Map an existing file read-only. Returns false if it can't be opened.
+    bool open_read(const char* filename) {
+        fd = ::open(filename, O_RDONLY);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) < 0) {
+            close();
+            return false;
+        }
+        size = st.st_size;
+        return map(PROT_READ, MAP_PRIVATE, MADV_SEQUENTIAL);
+    }
+
+    // Create (or truncate) a file of 'size' bytes and map it read-write.
+    // Returns false if it can't be created.
+    bool open_write(const char* filename, uint64_t size) {
+        fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) return false;
+
+        this->size = size;
+        if(ftruncate(fd, size) < 0) {
+            close();
+            return false;
+        }
+        return map(PROT_READ | PROT_WRITE, MAP_SHARED, MADV_WILLNEED);
+    }
+
+    void close() {
+        if(data) munmap(data, size);
+        if(fd >= 0) ::close(fd);
+        data = nullptr;
+        size = 0;
+        fd = -1;
+    }
+
+private:
+    // Empty files can't be mapped, they are left with a null 'data'
+    bool map(int prot, int flags, int advice) {
+        if(size == 0) return true;
+
+        void* p = mmap(nullptr, size, prot, flags, fd, 0);
+        if(p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        data = (char*)p;
+        madvise(data, size, advice);
+        return true;
+    }
+};
+
+// Write a buffer out to a file through a mapping of it
+inline bool write_mapped(const char* filename, const char* data, uint64_t size) {
+    STAT_PHASE(PHASE_IO);
+    MappedFile out;
+    if(!out.open_write(filename, size))
+        return false;
+    if(size)
+        memcpy(out.data, data, size);
+    return true;
+}
+
+#endif
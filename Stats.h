@@ -0,0 +1,241 @@
+// Instrumentation
+//
+// Counters and phase timers for finding out where the time goes in the
+// codecs. They are only compiled in when INSTRUMENT is defined ("make clean;
+// make INSTRUMENT=1"). Otherwise the macros below expand to nothing, so the
+// normal build pays nothing for them.
+//
+// STAT_ADD(counter, n) adds n to one of the counters listed below, and
+// STAT_PHASE(phase) adds the time until the end of the enclosing scope to a
+// phase. Each thread counts into its own copy, so the hot paths never share a
+// cache line. Phases running on several threads at once add up to more than
+// the wall clock time, and a phase inside another, like the reads of a
+// stream while decoding it, counts towards both.
+//
+// STAT_START(program) at the top of main() turns the report on. When the
+// program exits, after all the threads are done, the totals are written as
+// JSON to stderr, or to the file named by the STATS_FILE environment variable.
+// The report also has the cycles, instructions, cache misses and branch
+// misses of the whole run from perf_event_open, or nulls where the kernel
+// doesn't allow it.
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef INSTRUMENT
+
+#include <bits/stdc++.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum StatCounter {
+    SYMBOLS_ENCODED,
+    SYMBOLS_DECODED,
+    CODE_BITS,
+    OUTPUT_REALLOCS,
+    HUFFMAN_BLOCKS,
+    HUFFMAN_PACKAGE_MERGES,
+    HUFFMAN_SLOW_DECODES,
+    FGK_UPDATES,
+    FGK_UPDATE_LEVELS,
+    FGK_SWAPS,
+    FGK_NEW_SYMBOLS,
+    FGK_TABLE_FILLS,
+    FGK_TABLE_INVALIDATIONS,
+    FGK_RESCALES,
+    FGK_RESETS,
+    VITTER_UPDATES,
+    VITTER_SLIDES,
+    VITTER_NEW_SYMBOLS,
+    NUM_COUNTERS
+};
+
+inline const char* const COUNTER_NAMES[NUM_COUNTERS] = {
+    "symbols_encoded", "symbols_decoded", "code_bits", "output_reallocs",
+    "huffman_blocks", "huffman_package_merges", "huffman_slow_decodes",
+    "fgk_updates", "fgk_update_levels", "fgk_swaps", "fgk_new_symbols",
+    "fgk_table_fills", "fgk_table_invalidations", "fgk_rescales",
+    "fgk_resets", "vitter_updates", "vitter_slides", "vitter_new_symbols"
+};
+
+enum StatPhase {
+    PHASE_FREQ,
+    PHASE_TREE,
+    PHASE_CODEGEN,
+    PHASE_ENCODE,
+    PHASE_DECODE,
+    PHASE_IO,
+    PHASE_LZ77_PARSE,
+    NUM_PHASES
+};
+
+inline const char* const PHASE_NAMES[NUM_PHASES] = {
+    "freq_table", "tree_build", "code_gen", "encode", "decode", "io",
+    "lz77_parse"
+};
+
+// Hardware counters for the whole process, including threads started later
+struct PerfCounters {
+    static const int COUNT = 4;
+    const char* names[COUNT] = {
+        "cycles", "instructions", "cache_misses", "branch_misses"
+    };
+    const uint64_t configs[COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int fds[COUNT] = {-1, -1, -1, -1};
+
+    void open() {
+        for(int i=0; i<COUNT; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    // Returns false if the counter isn't available
+    bool read(int i, uint64_t& value) {
+        return fds[i] >= 0 && ::read(fds[i], &value, 8) == 8;
+    }
+};
+
+struct ThreadStats;
+
+// Totals of the threads that have finished, and the ones still running
+struct StatsRegistry {
+    std::mutex m;
+    std::set<ThreadStats*> live;
+    uint64_t counts[NUM_COUNTERS] = {0};
+    uint64_t nanos[NUM_PHASES] = {0};
+
+    std::string program;
+    std::chrono::steady_clock::time_point start;
+    PerfCounters perf;
+
+    ~StatsRegistry();
+};
+
+inline StatsRegistry& stats_registry() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+struct ThreadStats {
+    uint64_t counts[NUM_COUNTERS] = {0};
+    uint64_t nanos[NUM_PHASES] = {0};
+
+    ThreadStats() {
+        StatsRegistry& r = stats_registry();
+        std::lock_guard<std::mutex> lock(r.m);
+        r.live.insert(this);
+    }
+
+    ~ThreadStats() {
+        StatsRegistry& r = stats_registry();
+        std::lock_guard<std::mutex> lock(r.m);
+        for(int i=0; i<NUM_COUNTERS; i++)
+            r.counts[i] += counts[i];
+        for(int i=0; i<NUM_PHASES; i++)
+            r.nanos[i] += nanos[i];
+        r.live.erase(this);
+    }
+};
+
+inline ThreadStats& thread_stats() {
+    thread_local ThreadStats stats;
+    return stats;
+}
+
+// Adds the time from construction to destruction to a phase
+struct PhaseTimer {
+    StatPhase phase;
+    std::chrono::steady_clock::time_point start;
+
+    PhaseTimer(StatPhase phase) : phase(phase),
+            start(std::chrono::steady_clock::now()) {};
+
+    ~PhaseTimer() {
+        thread_stats().nanos[phase] += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                    - start).count();
+    }
+};
+
+inline void stats_start(const char* program) {
+    StatsRegistry& r = stats_registry();
+    thread_stats();
+    r.program = program;
+    r.start = std::chrono::steady_clock::now();
+    r.perf.open();
+}
+
+// Runs at exit, once every thread has added in its totals
+inline StatsRegistry::~StatsRegistry() {
+    if(program.empty()) return;
+
+    for(ThreadStats* t : live) {
+        for(int i=0; i<NUM_COUNTERS; i++)
+            counts[i] += t->counts[i];
+        for(int i=0; i<NUM_PHASES; i++)
+            nanos[i] += t->nanos[i];
+    }
+    double wall = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream file;
+    const char* filename = getenv("STATS_FILE");
+    if(filename)
+        file.open(filename);
+    std::ostream& os = filename ? file : std::cerr;
+
+    os << std::setprecision(9) << "{\"program\": \"" << program
+       << "\", \"wall_s\": " << wall << ",\n \"phases_s\": {";
+    for(int i=0; i<NUM_PHASES; i++)
+        os << (i ? ", " : "") << "\"" << PHASE_NAMES[i] << "\": "
+           << nanos[i] / 1e9;
+    os << "},\n \"counters\": {";
+    for(int i=0; i<NUM_COUNTERS; i++)
+        os << (i ? "," : "") << (i % 4 ? " " : "\n  ") << "\""
+           << COUNTER_NAMES[i] << "\": " << counts[i];
+    os << "},\n \"avg_code_bits\": ";
+    if(counts[SYMBOLS_ENCODED])
+        os << (double)counts[CODE_BITS] / counts[SYMBOLS_ENCODED];
+    else
+        os << "null";
+    os << ",\n \"hardware\": {";
+    for(int i=0; i<PerfCounters::COUNT; i++) {
+        uint64_t value;
+        os << (i ? ", " : "") << "\"" << perf.names[i] << "\": ";
+        if(perf.read(i, value))
+            os << value;
+        else
+            os << "null";
+    }
+    os << "}}" << std::endl;
+}
+
+#define STAT_CONCAT2(a, b) a##b
+#define STAT_CONCAT(a, b) STAT_CONCAT2(a, b)
+
+#define STAT_ADD(counter, n) (thread_stats().counts[counter] += (n))
+#define STAT_PHASE(phase) PhaseTimer STAT_CONCAT(phaseTimer, __LINE__)(phase)
+#define STAT_START(program) stats_start(program)
+
+#else
+
+// The count is left unevaluated, but still counts as a use of what it names
+#define STAT_ADD(counter, n) ((void)sizeof(n))
+#define STAT_PHASE(phase) ((void)0)
+#define STAT_START(program) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+// Thread Pool
+//
+// Shared by the compression programs to spread independent pieces of work,
+// such as blocks or segments of a file, over a fixed set of threads.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <bits/stdc++.h>
+
+// Fixed set of worker threads. parallel_for() hands out the indices 0..n-1 to
+// the workers (and the calling thread) and returns once all of them are done.
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable wake, done;
+
+    const std::function<void(int)>* job = nullptr;
+    int n = 0;
+    std::atomic<int> next{0};
+    int active = 0;
+    int generation = 0;
+    bool stop = false;
+
+    ThreadPool(int threads) {
+        for(int t=1; t<threads; t++)
+            workers.emplace_back([this]{ work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        wake.notify_all();
+        for(std::thread& t : workers)
+            t.join();
+    }
+
+    void run_jobs() {
+        for(int i=next++; i<n; i=next++)
+            (*job)(i);
+    }
+
+    void work() {
+        int seen = 0;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                wake.wait(lock, [&]{ return stop || generation != seen; });
+                if(stop) return;
+                seen = generation;
+            }
+
+            run_jobs();
+
+            std::lock_guard<std::mutex> lock(m);
+            if(--active == 0)
+                done.notify_one();
+        }
+    }
+
+    void parallel_for(int count, const std::function<void(int)>& f) {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            job = &f;
+            n = count;
+            next = 0;
+            active = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        run_jobs();
+
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [&]{ return active == 0; });
+    }
+};
+
+#endif
@@ -0,0 +1,635 @@
+// Dynamic/Adaptive Huffman Encoding (Vitter's Algorithm)
+//
+// This is an implementation of Vitter's dynamic huffman encoding, to compare
+// with the FGK algorithm in FGK.cpp. Both build the Huffman tree as they go,
+// so nothing but the encoded symbols has to be written out.
+//
+// Vitter's algorithm numbers the nodes from the bottom of the tree up, and
+// keeps them ordered by weight, with the leaves of each weight numbered below
+// the internal nodes of that weight. Nodes of the same weight and kind form
+// blocks that are contiguous in the numbering. When a weight goes up, the
+// node slides past the one block it now belongs ahead of, rather than being
+// swapped about level by level. Ordering leaves below internal nodes keeps the
+// tree as shallow as any Huffman tree for the same weights can be, so codes
+// come out no longer (and usually shorter) than with FGK, while each update
+// does at most one slide per level.
+//
+// This file (when supplied with a source file as the first argument) will
+// encode it using Vitter's algorithm, and write it to file. The file has the
+// name "compr_vitter.dat". Then the file will be decoded and written to disk
+// again as "orig_vitter.txt". We can diff the original source file with
+// "orig_vitter.txt" to ensure the process has not lost any data.
+//
+// With "-m" the files are streamed through a chunk at a time instead of being
+// held in memory, so memory use stays bounded no matter how large the input.
+//
+// Built with CODEC_LIBRARY defined, main() is left out and the codec goes into
+// libcodec.a instead, behind the interface in Codec.h.
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+
+#include "BitIO.h"
+#include "Codec.h"
+#include "MappedFile.h"
+
+namespace vitter {
+
+// Nodes are referred to by their index in the tree's node pool
+typedef uint16_t NodeId;
+const NodeId NO_NODE = UINT16_MAX;
+
+// Representation of a node in the Huffman tree. Where a node sits in the
+// tree is given by its place in the numbering alone: places 1 and 2 are the
+// children of the root at place 0, and every later pair of places are the
+// children of whichever node their 'parentOf' entry says. An internal node
+// knows which pair of places holds its children, so a node carries its
+// subtree along when it moves to a different place.
+struct TreeNode {
+    // Weights are never scaled down, so they count every symbol coded. At 64
+    // bits the root can't overflow before 2^64 bytes, far beyond any input.
+    uint64_t freq;
+
+    // Place in the numbering, 0 being the root and the highest number
+    int order;
+
+    // Children at places 2*pair+1 and 2*pair+2, for internal nodes
+    int pair;
+
+    // Block of nodes sharing this node's weight and kind
+    uint16_t block;
+
+    char c;
+    bool leafNode;
+};
+
+// The end of the data is written as the zero node's code, END_TEXT and a 1
+// bit. A new symbol that happens to be the byte END_TEXT is followed by a 0
+// bit instead, so every byte value can appear in the data.
+const char END_TEXT = -1;
+
+// Every symbol and the zero node as leaves, plus the internal nodes above them
+const int MAX_NODES = 2 * 257 - 1;
+
+// A run of nodes with the same weight and kind, contiguous in the numbering.
+// The leader is the highest numbered of them, the one closest to the root.
+struct WeightBlock {
+    int leader;
+};
+
+// The adaptive Huffman tree. The encoder and decoder both start from a lone
+// zero node and apply the same updates, so they stay in lockstep.
+struct VitterTree {
+    TreeNode nodes[MAX_NODES];
+    int size = 0;
+
+    // Nodes by their place in the numbering
+    NodeId byOrder[MAX_NODES];
+
+    // Place of the parent of each pair of places
+    int parentOf[MAX_NODES / 2];
+
+    // Weight blocks, and the ones not in use
+    WeightBlock blocks[MAX_NODES];
+    uint16_t freeBlocks[MAX_NODES];
+    int numFree = 0;
+
+    NodeId zeroNode;
+
+    // Node of each symbol seen so far
+    NodeId symbolNode[256];
+
+    // The root is the initial zero node
+    VitterTree() {
+        for(int i=MAX_NODES-1; i>=0; i--)
+            freeBlocks[numFree++] = i;
+        for(int s=0; s<256; s++)
+            symbolNode[s] = NO_NODE;
+        zeroNode = new_node(0);
+        nodes[zeroNode].block = new_block(0);
+    }
+
+    // New leaves of weight 0 go at the end of the numbering, which is always
+    // where the zero node and its block are
+    NodeId new_node(char c) {
+        TreeNode& node = nodes[size];
+        node.c = c;
+        node.freq = 0;
+        node.order = size;
+        node.leafNode = 1;
+        if(size > 0) node.block = nodes[byOrder[size - 1]].block;
+        byOrder[size] = size;
+        return size++;
+    }
+
+    uint16_t new_block(int leader) {
+        uint16_t b = freeBlocks[--numFree];
+        blocks[b].leader = leader;
+        return b;
+    }
+
+    // Place of the parent of the node at a place, or -1 for the root
+    int parent(int order) {
+        return order == 0 ? -1 : parentOf[(order - 1) / 2];
+    }
+
+    // Whether two nodes belong in the same block
+    bool same_block(NodeId a, NodeId b) {
+        return nodes[a].freq == nodes[b].freq
+            && nodes[a].leafNode == nodes[b].leafNode;
+    }
+};
+
+// Start from node in the tree and follow path to root. The second place of
+// a pair is the '1' branch. Each step up adds a bit above the ones collected
+// so far, so the code reads in the right order without reversing.
+Code genCode(VitterTree* tree, NodeId node) {
+    Code code = {0, 0};
+    int order = tree->nodes[node].order;
+    while(order > 0) {
+        code.bits |= (uint64_t)((order & 1) == 0) << code.len++;
+        order = tree->parent(order);
+    }
+    return code;
+}
+
+// Put a node at a place, bringing its children along if it has any
+void place(VitterTree* tree, NodeId node, int order) {
+    TreeNode& n = tree->nodes[node];
+    n.order = order;
+    tree->byOrder[order] = node;
+    if(!n.leafNode)
+        tree->parentOf[n.pair] = order;
+}
+
+// Exchange the places of two nodes, along with their subtrees
+void swap_nodes(VitterTree* tree, NodeId a, NodeId b) {
+    if(a == b) return;
+
+    int order = tree->nodes[a].order;
+    place(tree, a, tree->nodes[b].order);
+    place(tree, b, order);
+}
+
+// Take a node at the front of its block out of it. The next node in the
+// numbering leads the block from now on, if it belongs there.
+void leave_block(VitterTree* tree, NodeId node) {
+    TreeNode& n = tree->nodes[node];
+    int next = n.order + 1;
+    if(next < tree->size && tree->same_block(node, tree->byOrder[next]))
+        tree->blocks[n.block].leader = next;
+    else
+        tree->freeBlocks[tree->numFree++] = n.block;
+}
+
+// Put a node in the block of the node just ahead of it in the numbering, or
+// in a new block of its own if it doesn't belong there
+void join_block(VitterTree* tree, NodeId node) {
+    TreeNode& n = tree->nodes[node];
+    if(n.order > 0 && tree->same_block(node, tree->byOrder[n.order - 1]))
+        n.block = tree->nodes[tree->byOrder[n.order - 1]].block;
+    else
+        n.block = tree->new_block(n.order);
+}
+
+// Add one to the weight of a node at the front of its block. If it then
+// belongs ahead of the block just ahead of it (a leaf passing internal nodes
+// of its old weight, or an internal node passing leaves of its new weight)
+// it slides past that block, which shifts back a place to make room.
+//
+// Returns the node to update next. A leaf that slides lands under a new
+// parent, which gains the weight. An internal node that slides leaves a
+// heavier leaf in its old place, so the old parent gains the weight instead.
+// Either way, the node returned is at the front of its block.
+NodeId slide_and_increment(VitterTree* tree, NodeId node) {
+    TreeNode* nodes = tree->nodes;
+    TreeNode& n = nodes[node];
+    int oldOrder = n.order;
+
+    leave_block(tree, node);
+
+    NodeId ahead = oldOrder > 0 ? tree->byOrder[oldOrder - 1] : NO_NODE;
+    bool slide = ahead != NO_NODE && (n.leafNode
+        ? !nodes[ahead].leafNode && nodes[ahead].freq == n.freq
+        : nodes[ahead].leafNode && nodes[ahead].freq == n.freq + 1);
+
+    if(slide) {
+        STAT_ADD(VITTER_SLIDES, 1);
+        // Every node of that block moves back a place, and the node takes
+        // the place of its leader
+        WeightBlock& b = tree->blocks[nodes[ahead].block];
+        for(int order=oldOrder; order>b.leader; order--)
+            place(tree, tree->byOrder[order - 1], order);
+        place(tree, node, b.leader);
+        b.leader++;
+    }
+
+    n.freq++;
+    join_block(tree, node);
+
+    int next = slide && !n.leafNode ? oldOrder : n.order;
+    next = tree->parent(next);
+    return next < 0 ? NO_NODE : tree->byOrder[next];
+}
+
+// Bring the weight of a leaf up by one, along with all nodes above it
+void update_freq(VitterTree* tree, NodeId leaf) {
+    STAT_ADD(VITTER_UPDATES, 1);
+    NodeId node = leaf;
+    NodeId leafToIncrement = NO_NODE;
+
+    if(tree->nodes[leaf].freq > 0) {
+        // Move to the front of the block first, as only the front node can
+        // gain weight without getting ahead of the rest of its block
+        TreeNode& n = tree->nodes[leaf];
+        swap_nodes(tree, leaf, tree->byOrder[tree->blocks[n.block].leader]);
+
+        // The sibling of the zero node weighs as much as its parent, which
+        // would get in its way. Its parent and everything above goes first.
+        int parent = tree->parent(n.order);
+        int sibling = n.order & 1 ? n.order + 1 : n.order - 1;
+        if(parent >= 0 && tree->byOrder[sibling] == tree->zeroNode) {
+            leafToIncrement = leaf;
+            node = tree->byOrder[parent];
+        }
+    } else {
+        // A new symbol: the old zero node above it goes first
+        leafToIncrement = leaf;
+        node = tree->byOrder[tree->parent(tree->nodes[leaf].order)];
+    }
+
+    while(node != NO_NODE)
+        node = slide_and_increment(tree, node);
+    if(leafToIncrement != NO_NODE)
+        slide_and_increment(tree, leafToIncrement);
+}
+
+// Turn the zero node into an internal node with the new symbol and a new zero
+// node below it, and return the new symbol's leaf (still at weight 0)
+NodeId add_symbol(VitterTree* tree, char c) {
+    STAT_ADD(VITTER_NEW_SYMBOLS, 1);
+    NodeId zeroNode = tree->zeroNode;
+    TreeNode& old = tree->nodes[zeroNode];
+
+    // Its children take the next pair of places, the symbol first so that
+    // the zero node stays last in the numbering
+    int pair = tree->size / 2;
+    NodeId leaf = tree->new_node(c);
+    tree->zeroNode = tree->new_node(0);
+    tree->parentOf[pair] = old.order;
+
+    // As an internal node of weight 0, the old zero node is in a block of
+    // its own ahead of the new leaves
+    leave_block(tree, zeroNode);
+    old.leafNode = 0;
+    old.pair = pair;
+    join_block(tree, zeroNode);
+
+    tree->symbolNode[(unsigned char)c] = leaf;
+    return leaf;
+}
+
+// Dynamically encode data to binary format, appending it to the writer's
+// output. The writer keeps any bits that don't fill a whole word between
+// calls, so that a file can be encoded a chunk at a time.
+void encode(VitterTree* tree, BitWriter* writer, char* data, uint64_t N) {
+    STAT_PHASE(PHASE_ENCODE);
+    STAT_ADD(SYMBOLS_ENCODED, N);
+    for(uint64_t dataPos=0; dataPos<N; dataPos++) {
+        char cur = data[dataPos];
+
+        // Does the current sybol already exist in the tree?
+        NodeId node = tree->symbolNode[(unsigned char)cur];
+        if(node != NO_NODE) {
+            // Generate the code for this symbol and write it to output
+            Code code = genCode(tree, node);
+            writer->put(code.bits, code.len);
+            STAT_ADD(CODE_BITS, code.len);
+        }
+        else {
+            // Get code of zero node followed by full symbol
+            Code code = genCode(tree, tree->zeroNode);
+            writer->put(code.bits, code.len);
+            writer->put((unsigned char)cur, 8);
+            if(cur == END_TEXT)
+                writer->put(0, 1);
+            STAT_ADD(CODE_BITS, code.len + 8 + (cur == END_TEXT));
+            node = add_symbol(tree, cur);
+        }
+
+        // Perform any operations on the tree to keep it a Huffman tree
+        update_freq(tree, node);
+    }
+}
+
+// Mark the end of the data
+void encode_end(VitterTree* tree, BitWriter* writer) {
+    Code code = genCode(tree, tree->zeroNode);
+    writer->put(code.bits, code.len);
+    writer->put((unsigned char)END_TEXT, 8);
+    writer->put(1, 1);
+}
+
+// The bitstream starts with a magic number, so data from another codec is
+// rejected rather than decoded into garbage:
+//    4 bytes   magic "VITA"
+const char MAGIC[4] = {'V','I','T','A'};
+const int HEADER_SIZE = 4;
+
+// Dynamically encode a whole buffer to binary format, terminated by END_TEXT
+std::vector<char>* encode(char* data, uint64_t N) {
+    std::vector<char>* output = new std::vector<char>(MAGIC, MAGIC + 4);
+    output->resize(HEADER_SIZE + N + 16);
+    VitterTree tree;
+    BitWriter writer(output);
+    writer.pos = HEADER_SIZE;
+
+    encode(&tree, &writer, data, N);
+    encode_end(&tree, &writer);
+    writer.flush();
+
+    return output;
+}
+
+// Dynamically decode data from binary format, until END_TEXT is found or
+// 'limit' bytes have been added to output. 'ended' is set once END_TEXT is
+// found, and left alone when the data runs out before it.
+//
+// Returns false once the end of the data has been reached.
+bool decode(VitterTree* tree, BitReader* in, std::vector<char>* output,
+        uint64_t limit, bool& ended) {
+    STAT_PHASE(PHASE_DECODE);
+    uint64_t start = output->size();
+    while(output->size() < limit) {
+        // Start from the root and go down a pair of places for every bit
+        // until we reach a leaf node. The bits come from one look at the
+        // reader's accumulator, which covers all but the deepest codes.
+        NodeId cur = tree->byOrder[0];
+        uint64_t bits = in->peek(56);
+        int used = 0;
+        while(!tree->nodes[cur].leafNode && used < 56)
+            cur = tree->byOrder[2*tree->nodes[cur].pair + 1
+                + (bits >> (55 - used++) & 1)];
+        in->consume(used);
+        while(!tree->nodes[cur].leafNode)
+            cur = tree->byOrder[2*tree->nodes[cur].pair + 1 + in->bit()];
+
+        // If we ended on the zero node, the next byte is a new symbol to be
+        // added to the tree
+        char temp = 0;
+        if(cur == tree->zeroNode) {
+            for(int i=0; i<8; i++)
+                temp = (temp << 1) | in->bit();
+
+            // END_TEXT is followed by a bit telling the end apart from a
+            // byte of that value
+            if(temp == END_TEXT && (in->bit() || in->exhausted)) {
+                ended = !in->exhausted;
+                break;
+            }
+            cur = add_symbol(tree, temp);
+        }
+        else {
+            temp = tree->nodes[cur].c;
+        }
+
+        // Check for data that ended without an end mark
+        if(in->exhausted) break;
+
+        // Write to output buffer and update frequencies in the tree
+        output->push_back(temp);
+        update_freq(tree, cur);
+    }
+
+    STAT_ADD(SYMBOLS_DECODED, output->size() - start);
+    return output->size() >= limit;
+}
+
+// Dynamically decode a whole buffer from binary format. Returns nullptr if
+// it is not a Vitter bitstream, or is cut short of its end mark.
+std::vector<char>* decode(char* data, uint64_t N) {
+    if(N < HEADER_SIZE || memcmp(data, MAGIC, 4))
+        return nullptr;
+
+    std::vector<char>* output = new std::vector<char>;
+    VitterTree tree;
+    BitReader in(data + HEADER_SIZE, N - HEADER_SIZE);
+
+    bool ended = false;
+    decode(&tree, &in, output, UINT64_MAX, ended);
+    if(!ended) {
+        delete output;
+        return nullptr;
+    }
+    return output;
+}
+
+// Encode a stream a chunk at a time, writing the output as it goes.
+// Returns the number of bytes read.
+uint64_t encode_stream(std::istream& is, std::ostream& os) {
+    VitterTree tree;
+    std::vector<char> output(MAGIC, MAGIC + 4);
+    output.resize(HEADER_SIZE + CHUNK_SIZE + 16);
+    BitWriter writer(&output);
+    writer.pos = HEADER_SIZE;
+
+    uint64_t total = encode_chunks(is, os, writer,
+        [&](char* data, uint64_t n) { encode(&tree, &writer, data, n); });
+
+    encode_end(&tree, &writer);
+    writer.flush();
+    STAT_PHASE(PHASE_IO);
+    os.write(output.data(), output.size());
+
+    return total;
+}
+
+// Decode a stream a chunk at a time, writing the output as it goes.
+// Returns false if it is not a Vitter bitstream, or is cut short of its end
+// mark.
+bool decode_stream(std::istream& is, std::ostream& os) {
+    char header[HEADER_SIZE];
+    if(!is.read(header, HEADER_SIZE) || memcmp(header, MAGIC, 4))
+        return false;
+
+    VitterTree tree;
+    BitReader in(is);
+
+    bool ended = false;
+    decode_chunks(os, [&](std::vector<char>* output) {
+        return decode(&tree, &in, output, CHUNK_SIZE, ended);
+    });
+    return ended;
+}
+
+// Vitter's coder behind the common Codec interface. It has no settings.
+struct VitterCodec : Codec {
+    std::vector<char>* compress(char* data, uint64_t N) {
+        return encode(data, N);
+    }
+
+    std::vector<char>* decompress(char* data, uint64_t N) {
+        return decode(data, N);
+    }
+
+    bool compress(std::istream& is, std::ostream& os) {
+        encode_stream(is, os);
+        return is.eof() && os;
+    }
+
+    bool decompress(std::istream& is, std::ostream& os) {
+        return decode_stream(is, os) && os;
+    }
+};
+
+} // namespace vitter
+
+Codec* new_vitter_codec(const CodecOptions&) {
+    return new vitter::VitterCodec;
+}
+
+#ifndef CODEC_LIBRARY
+using namespace vitter;
+
+void usage() {
+    std::cerr << "usage: Vitter [-m] <file>" << std::endl;
+}
+
+int main (int argc, char *argv[]) {
+    STAT_START("Vitter");
+    bool streaming = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "m")) != -1) {
+        switch(opt) {
+            case 'm': streaming = true; break;
+            default: usage(); return -1;
+        }
+    }
+    if(optind >= argc) {
+        std::cerr << "no filename provided" << std::endl;
+        usage();
+        return -1;
+    }
+    char* filename = argv[optind];
+
+    uint64_t data_size, data_size2;
+    MappedFile input;
+    std::vector<char>* encoded = nullptr;
+    std::vector<char>* decoded = nullptr;
+    double encode_time, decode_time;
+    bool matching = true;
+
+    if(streaming) {
+        // Open file
+        std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+        if(!ifs) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+
+        // Determine length
+        data_size = ifs.tellg();
+        ifs.seekg(0, ifs.beg);
+
+        std::cout << "Compressing file..." << std::endl;
+
+        // Encode file straight to disk
+        std::ofstream ofs("compr_vitter.dat", std::ios::out | std::ios::binary);
+        std::clock_t encode_start = std::clock();
+        encode_stream(ifs, ofs);
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        data_size2 = ofs.tellp();
+        ofs.close();
+
+        std::cout << "Decompressing file..." << std::endl;
+
+        // Decode file straight to disk
+        ifs.close();
+        ifs.open("compr_vitter.dat", std::ios::in | std::ios::binary);
+        ofs.open("orig_vitter.txt", std::ios::out | std::ios::binary);
+        std::clock_t decode_start = std::clock();
+        bool decoded = decode_stream(ifs, ofs);
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+        ofs.close();
+
+        std::cout << "Testing files..." << std::endl;
+
+        // Check for inconsistencies
+        matching = decoded && files_match(filename, "orig_vitter.txt");
+    } else {
+        // Map the file into memory
+        if(!input.open_read(filename)) {
+            std::cerr << "error opening file" << std::endl;
+            return -1;
+        }
+        data_size = input.size;
+
+        std::cout << "Compressing file..." << std::endl;
+
+        // Encode file
+        std::clock_t encode_start = std::clock();
+        encoded = encode(input.data, data_size);
+        encode_time = (std::clock() - encode_start)/(double)CLOCKS_PER_SEC;
+        data_size2 = encoded->size();
+
+        std::cout << "Writing to disk..." << std::endl;
+
+        // Write compressed data to file
+        if(!write_mapped("compr_vitter.dat", encoded->data(), data_size2)) {
+            std::cerr << "error writing file" << std::endl;
+            return -1;
+        }
+
+        std::cout << "Decompressing file..." << std::endl;
+
+        // Decode the compressed data still in memory
+        std::clock_t decode_start = std::clock();
+        decoded = decode(encoded->data(), data_size2);
+        if(!decoded) {
+            std::cerr << "Invalid compressed file" << std::endl;
+            decoded = new std::vector<char>;
+        }
+        decode_time = (std::clock() - decode_start)/(double)CLOCKS_PER_SEC;
+
+        std::cout << "Testing files..." << std::endl;
+
+        // Check for inconsistencies
+        matching = decoded->size() == data_size
+            && (data_size == 0
+                || !memcmp(input.data, decoded->data(), data_size));
+
+        // Write decoded file to disk
+        write_mapped("orig_vitter.txt", decoded->data(), decoded->size());
+    }
+
+    // Display results
+    if(!matching) {
+        std::cerr << "error encoding data... files do not match!" << std::endl;
+    } else {
+        std::cout << "Compression success! files match 100%" << std::endl;
+        std::cout << "======================================\n";
+        std::cout << std::left << std::setw(22)
+                << "Original file size: " << "| " << data_size << "B\n";
+        std::cout << std::left << std::setw(22)
+                << "Compressed size: " << "| " << data_size2 << "B\n";
+        std::cout << std::left << std::setw(22)
+                << "Reduction: " << "| " << std::fixed << std::setprecision(2)
+                << 100 - ((double)data_size2 / data_size) * 100 << "%"
+                << std::endl;
+        std::cout << "======================================\n";
+        std::cout << "Encoding Duration: "
+                << std::fixed << std::setprecision(2) << encode_time << "s\n";
+        std::cout << "Decoding Duration: "
+                << std::fixed << std::setprecision(2) << decode_time << "s\n";
+        std::cout<<std::endl;
+    }
+
+    // Clean up
+    delete encoded;
+    delete decoded;
+
+    return 0;
+}
+
+#endif
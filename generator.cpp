@@ -1,31 +1,160 @@
-// Random Byte Generator
+// Random Data Generator
 // Author: Dustin Ward
 // Date: March 24th, 2023
 //
 // This is a random data generator for my CPSC4660 (Database Management
 // systems) class. It generates files of pre-defined sizes consisting of random
 // information. These files were used to test various compression algorithms.
+//
+// Run without arguments it writes the uniform random files in testing_data.
+// Otherwise it writes one file of any size (with a k, M or G suffix) drawn
+// from one of these distributions:
+//
+//   uniform   bytes spread evenly over 1..254, which don't compress at all
+//   zipf      bytes whose frequencies fall off as 1/rank^s ("-z s")
+//   markov    text from an order-k Markov model ("-k k") of some training
+//             text, built in or read from a file with "-t"
+//   log       server log lines made of a few repeated tokens, with
+//             increasing timestamps
+//   binary    fixed size little endian records of mostly small numbers
+//
+// The output only depends on the arguments and the seed ("-S"), so the same
+// command always gives the same file. The distributions are in Generator.h,
+// shared with the benchmark. Data is generated and written a chunk at a time,
+// so files can be many GB.
 
 #include <bits/stdc++.h>
+#include <unistd.h>
+
+#include "Generator.h"
+
 using namespace std;
 
 const string filepath = "./testing_data/random";
 
 vector<int> sizes = {100, 1000, 10000, 100000};
 
-int main() {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> dist(1,254);
+const int CHUNK_SIZE = 1 << 20;
+
+// Parse a size like 100, 64k, 512M or 4G
+bool parse_size(const char* s, uint64_t& size) {
+    char* end;
+    size = strtoull(s, &end, 10);
+    switch(tolower(*end)) {
+        case 'k': size <<= 10; end++; break;
+        case 'm': size <<= 20; end++; break;
+        case 'g': size <<= 30; end++; break;
+    }
+    return end != s && *end == 0;
+}
+
+bool read_file(const string& filename, string& text) {
+    ifstream ifs(filename, ios::in | ios::binary);
+    if(!ifs) return false;
+    text.assign(istreambuf_iterator<char>(ifs), {});
+    return true;
+}
+
+// Write 'size' bytes from the generator to a file, a chunk at a time
+bool write_generated(const string& filename, Generator& gen, uint64_t size) {
+    ofstream ofs(filename, ios::out | ios::binary);
+    string chunk;
+    uint64_t written = 0;
+    while(ofs && written < size) {
+        while(chunk.size() < CHUNK_SIZE)
+            gen.generate(chunk);
+        uint64_t n = min<uint64_t>(CHUNK_SIZE, size - written);
+        ofs.write(chunk.data(), n);
+        chunk.erase(0, n);
+        written += n;
+    }
+    return (bool)ofs;
+}
+
+void usage() {
+    cerr << "usage: generator [-d uniform|zipf|markov|log|binary] "
+            "[-s size] [-S seed] [-z zipf s] [-k markov order] "
+            "[-t training file] [-o output]" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    string dist, output, training;
+    string sizeName = "1M";
+    uint64_t size = 1 << 20, seed = 4660;
+    double s = 1.0;
+    int order = 3;
+
+    int opt;
+    while((opt = getopt(argc, argv, "d:k:o:s:S:t:z:")) != -1) {
+        switch(opt) {
+            case 'd': dist = optarg; break;
+            case 'k': order = atoi(optarg); break;
+            case 'o': output = optarg; break;
+            case 's': sizeName = optarg; break;
+            case 'S': seed = strtoull(optarg, nullptr, 10); break;
+            case 't': training = optarg; break;
+            case 'z': s = atof(optarg); break;
+            default: usage(); return -1;
+        }
+    }
+    if(!parse_size(sizeName.c_str(), size)) {
+        cerr << "invalid size: " << sizeName << endl;
+        return -1;
+    }
+    if(order < 0 || order > 16) {
+        cerr << "markov order must be between 0 and 16" << endl;
+        return -1;
+    }
+
+    Random rnd(seed);
 
-    for(int i:sizes) {
-        string new_filepath = filepath + to_string(i) + ".txt";
+    // The original set of test files
+    if(dist.empty()) {
+        for(int i:sizes) {
+            string new_filepath = filepath + to_string(i) + ".txt";
+            UniformGenerator gen(rnd);
+            if(!write_generated(new_filepath, gen, i)) {
+                cerr << "error writing " << new_filepath << endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
 
-        char* buffer = new char[i];
-        for(int j=0; j<i; j++)
-            buffer[j] = dist(rng);
+    Generator* gen = nullptr;
+    if(dist == "uniform") {
+        gen = new UniformGenerator(rnd);
+    } else if(dist == "zipf") {
+        gen = new ZipfGenerator(rnd, s);
+    } else if(dist == "markov") {
+        string text = TRAINING_TEXT;
+        if(!training.empty() && !read_file(training, text)) {
+            cerr << "error opening file " << training << endl;
+            return -1;
+        }
+        if(text.size() <= (size_t)order) {
+            cerr << "training text is shorter than the markov order" << endl;
+            return -1;
+        }
+        gen = new MarkovGenerator(rnd, text, order);
+    } else if(dist == "log") {
+        gen = new LogGenerator(rnd);
+    } else if(dist == "binary") {
+        gen = new BinaryGenerator(rnd);
+    } else {
+        cerr << "unknown distribution: " << dist << endl;
+        usage();
+        return -1;
+    }
 
-        ofstream ofs(new_filepath, ios::out | ios::binary);
-        ofs.write(buffer, i);
+    if(output.empty())
+        output = "./testing_data/" + dist + sizeName + ".txt";
+    bool ok = write_generated(output, *gen, size);
+    delete gen;
+    if(!ok) {
+        cerr << "error writing " << output << endl;
+        return -1;
     }
+
+    return 0;
 }